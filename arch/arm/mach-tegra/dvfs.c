@@ -28,6 +28,7 @@
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/suspend.h>
+#include <linux/suspend_latency.h>
 #include <linux/delay.h>
 
 #include <mach/clk.h>
@@ -389,13 +390,21 @@ static int tegra_dvfs_suspend(void)
 static int tegra_dvfs_pm_notify(struct notifier_block *nb,
 				unsigned long event, void *data)
 {
+	u64 start = suspend_latency_start();
+	int ret;
+
 	switch (event) {
 	case PM_SUSPEND_PREPARE:
-		if (tegra_dvfs_suspend())
+		ret = tegra_dvfs_suspend();
+		suspend_latency_record(SUSPEND_LATENCY_PM_NOTIFIER, start, ret,
+				       "tegra_dvfs_suspend");
+		if (ret)
 			return NOTIFY_STOP;
 		break;
 	case PM_POST_SUSPEND:
 		tegra_dvfs_resume();
+		suspend_latency_record(SUSPEND_LATENCY_PM_NOTIFIER, start, 0,
+				       "tegra_dvfs_resume");
 		break;
 	}
 
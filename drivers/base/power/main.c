@@ -27,6 +27,7 @@
 #include <linux/sched.h>
 #include <linux/async.h>
 #include <linux/suspend.h>
+#include <linux/suspend_latency.h>
 #include <linux/timer.h>
 
 #include "../base.h"
@@ -212,6 +213,24 @@ static void dpm_wait_for_children(struct device *dev, bool async)
        device_for_each_child(dev, &async, dpm_wait_fn);
 }
 
+/**
+ * dpm_latency_phase - Tell which suspend_latency phase a callback is in.
+ * @state: PM transition of the system being carried out.
+ * @noirq: Whether the callback runs with device interrupts disabled.
+ */
+static enum suspend_latency_phase dpm_latency_phase(pm_message_t state,
+						    bool noirq)
+{
+	bool resume = state.event & (PM_EVENT_RESUME | PM_EVENT_THAW |
+				     PM_EVENT_RESTORE | PM_EVENT_RECOVER);
+
+	if (noirq)
+		return resume ? SUSPEND_LATENCY_DEV_RESUME_NOIRQ :
+				SUSPEND_LATENCY_DEV_SUSPEND_NOIRQ;
+	return resume ? SUSPEND_LATENCY_DEV_RESUME :
+			SUSPEND_LATENCY_DEV_SUSPEND;
+}
+
 /**
  * pm_op - Execute the PM operation appropriate for given PM event.
  * @dev: Device to handle.
@@ -224,6 +243,7 @@ static int pm_op(struct device *dev,
 {
 	int error = 0;
 	ktime_t calltime;
+	u64 start = suspend_latency_start();
 
 	calltime = initcall_debug_start(dev);
 
@@ -275,6 +295,8 @@ static int pm_op(struct device *dev,
 	}
 
 	initcall_debug_report(dev, calltime, error);
+	suspend_latency_record(dpm_latency_phase(state, false), start, error,
+			       "%s", dev_name(dev));
 
 	return error;
 }
@@ -294,6 +316,7 @@ static int pm_noirq_op(struct device *dev,
 {
 	int error = 0;
 	ktime_t calltime = ktime_set(0, 0), delta, rettime;
+	u64 start = suspend_latency_start();
 
 	if (initcall_debug) {
 		pr_info("calling  %s+ @ %i, parent: %s\n",
@@ -356,6 +379,8 @@ static int pm_noirq_op(struct device *dev,
 			dev_name(dev), error,
 			(unsigned long long)ktime_to_ns(delta) >> 10);
 	}
+	suspend_latency_record(dpm_latency_phase(state, true), start, error,
+			       "%s", dev_name(dev));
 
 	return error;
 }
@@ -494,6 +519,7 @@ static int legacy_resume(struct device *dev, int (*cb)(struct device *dev))
 {
 	int error;
 	ktime_t calltime;
+	u64 start = suspend_latency_start();
 
 	calltime = initcall_debug_start(dev);
 
@@ -501,6 +527,8 @@ static int legacy_resume(struct device *dev, int (*cb)(struct device *dev))
 	suspend_report_result(cb, error);
 
 	initcall_debug_report(dev, calltime, error);
+	suspend_latency_record(SUSPEND_LATENCY_DEV_RESUME, start, error,
+			       "%s", dev_name(dev));
 
 	return error;
 }
@@ -851,6 +879,7 @@ static int legacy_suspend(struct device *dev, pm_message_t state,
 {
 	int error;
 	ktime_t calltime;
+	u64 start = suspend_latency_start();
 
 	calltime = initcall_debug_start(dev);
 
@@ -858,6 +887,8 @@ static int legacy_suspend(struct device *dev, pm_message_t state,
 	suspend_report_result(cb, error);
 
 	initcall_debug_report(dev, calltime, error);
+	suspend_latency_record(SUSPEND_LATENCY_DEV_SUSPEND, start, error,
+			       "%s", dev_name(dev));
 
 	return error;
 }
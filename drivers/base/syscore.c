@@ -9,6 +9,7 @@
 #include <linux/syscore_ops.h>
 #include <linux/mutex.h>
 #include <linux/module.h>
+#include <linux/suspend_latency.h>
 
 static LIST_HEAD(syscore_ops_list);
 static DEFINE_MUTEX(syscore_ops_lock);
@@ -53,9 +54,13 @@ int syscore_suspend(void)
 
 	list_for_each_entry_reverse(ops, &syscore_ops_list, node)
 		if (ops->suspend) {
+			u64 start = suspend_latency_start();
+
 			if (initcall_debug)
 				pr_info("PM: Calling %pF\n", ops->suspend);
 			ret = ops->suspend();
+			suspend_latency_record(SUSPEND_LATENCY_SYSCORE_SUSPEND,
+					       start, ret, "%pF", ops->suspend);
 			if (ret)
 				goto err_out;
 			WARN_ONCE(!irqs_disabled(),
@@ -89,9 +94,13 @@ void syscore_resume(void)
 
 	list_for_each_entry(ops, &syscore_ops_list, node)
 		if (ops->resume) {
+			u64 start = suspend_latency_start();
+
 			if (initcall_debug)
 				pr_info("PM: Calling %pF\n", ops->resume);
 			ops->resume();
+			suspend_latency_record(SUSPEND_LATENCY_SYSCORE_RESUME,
+					       start, 0, "%pF", ops->resume);
 			WARN_ONCE(!irqs_disabled(),
 				"Interrupts enabled after %pF\n", ops->resume);
 		}
@@ -147,6 +147,26 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * Scatter-gather form of binder_transaction_data, used with
+ * BC_TRANSACTION_SG and BC_REPLY_SG.  The data buffer is gathered from
+ * the sg_count entries at sg instead of being read from data.ptr.buffer,
+ * and data_size must be the sum of their sizes.  The offsets still come
+ * from data.ptr.offsets and index into the gathered buffer, so a segment
+ * may carry a BINDER_TYPE_FD object to pass an ashmem or nvmap region by
+ * reference instead of copying its contents.
+ */
+struct binder_sg_entry {
+	const void	*buffer;
+	size_t		size;
+};
+
+struct binder_transaction_data_sg {
+	struct binder_transaction_data	transaction_data;
+	const struct binder_sg_entry	*sg;
+	size_t				sg_count;	/* at most UIO_MAXIOV */
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +344,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with the data
+	 * gathered from a list of user buffers.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
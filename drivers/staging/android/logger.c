@@ -20,49 +20,154 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * struct logger_ring - the storage of a log
+ *
+ * A log's ring is replaced when the log is resized. Users that do not hold
+ * log->lock find it under rcu_read_lock(), and the old ring is freed after a
+ * grace period.
+ */
+struct logger_ring {
+	unsigned char		*buffer;	/* the ring buffer itself */
+	size_t			size;		/* size, a power of two */
+};
+
+/*
+ * struct logger_uid_usage - how many bytes of a log's entries one euid wrote
+ *
+ * Only tracked for euids that have entries in the log. Protected by log->lock.
+ */
+struct logger_uid_usage {
+	struct hlist_node	node;	/* entry in logger_log's uid_usage */
+	uid_t			euid;	/* writer's effective UID */
+	size_t			bytes;	/* bytes of its entries in the log */
+	size_t			oldest;	/* none of its entries are before this */
+};
+
+#define LOGGER_UID_HASH_BITS	5
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Positions in the log are free-running byte counts; the offset of a position
+ * within the ring buffer is logger_offset(ring, pos).  Everything between
+ * 'head' and 'w_pos' is a sequence of complete entries.  Writers are
+ * serialized by the spinlock 'lock' and never touch user memory while holding
+ * it.  Readers take it only to copy one entry out of the ring.
+ *
+ * Entries expunged to keep a euid under the quota are squeezed out by
+ * compact_log(), which moves the newer entries, and the readers positioned
+ * among them, down over the gaps. It runs from 'compact_work' a batch at a
+ * time, and between batches the expunged bytes it has passed form a single
+ * gap from 'compact_to' to 'compact_from', which everyone else steps over.
  */
 struct logger_log {
-	unsigned char 		*buffer;/* the ring buffer itself */
+	struct logger_ring __rcu *ring;	/* the ring buffer */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
+	spinlock_t		lock;	/* serializes writers */
+	size_t			w_pos;	/* position of the next write */
+	size_t			head;	/* oldest entry, new readers start here */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
-	size_t			size;	/* size of the log */
+	size_t			uid_quota; /* max bytes per euid, 0 for none */
+	struct hlist_head	uid_usage[1 << LOGGER_UID_HASH_BITS];
+	size_t			expunged; /* bytes of expunged entries */
+	unsigned int		compactions; /* bumped by compact_log() */
+	unsigned int		expunges; /* bumped by expunge_uid() */
+	atomic_t		mappings; /* vmas mapping the ring */
+	struct work_struct	compact_work; /* runs compact_log() */
+	size_t			compact_to; /* start of the compaction gap */
+	size_t			compact_from; /* end of it, next to compact */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by 'mutex'; 'list' and
+ * 'r_pos' are also protected by log->lock, since compact_log() moves readers.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct list_head	list;	/* entry in log's readers list */
+	struct mutex		mutex;	/* serializes reads on this file */
+	size_t			r_pos;	/* position of the next read */
 	bool			r_all;	/* reader can read all entries */
+	bool			r_batch; /* read() returns many entries */
+	bool			r_pending; /* 'entry' was fetched, not read */
 	int			r_ver;	/* reader ABI version */
+	struct logger_entry	*entry;	/* copy of the entry before r_pos */
 };
 
-/* logger_offset - returns index 'n' into the log via (optimized) modulus */
-#define logger_offset(n)	((n) & (log->size - 1))
+#define LOGGER_ENTRY_MAX_LEN \
+	(sizeof(struct logger_entry) + LOGGER_ENTRY_MAX_PAYLOAD)
+
+/* bounds for LOGGER_SET_LOG_BUF_SIZE */
+#define LOGGER_MIN_LOG_SIZE	(64 * 1024)
+#define LOGGER_MAX_LOG_SIZE	(16 * 1024 * 1024)
+
+/* the log is compacted once this fraction of it (as a shift) is expunged */
+#define LOGGER_COMPACT_SHIFT	3
+
+/* bytes compact_log() goes through before it lets writers have log->lock */
+#define LOGGER_COMPACT_BATCH	(16 * 1024)
+
+/* entries a writer's expunge_uid() looks at */
+#define LOGGER_EXPUNGE_BATCH	64
+
+/* entries a reader skips before it lets writers have log->lock */
+#define LOGGER_FETCH_BATCH	64
+
+/* unlocked copy passes a resize makes before it takes log->lock */
+#define LOGGER_RESIZE_PASSES	4
+
+/* serializes LOGGER_SET_LOG_BUF_SIZE, so the ring only changes under it */
+static DEFINE_MUTEX(logger_resize_mutex);
+
+/*
+ * Per-cpu buffers in which writers assemble an entry before taking the log's
+ * lock, so that a fault on the user buffer never happens with the lock held.
+ */
+static void __percpu *logger_stage;
+
+/* logger_offset - returns index 'n' into the ring via (optimized) modulus */
+#define logger_offset(ring, n)	((n) & ((ring)->size - 1))
+
+/* log_ring - returns the ring of 'log' to a writer. */
+static inline struct logger_ring *log_ring(struct logger_log *log)
+{
+	return rcu_dereference_protected(log->ring,
+					 lockdep_is_held(&log->lock));
+}
+
+/*
+ * skip_gap - returns the position of the entry at 'pos' in 'log', which is
+ * past the compaction gap if 'pos' is where the gap starts.
+ *
+ * Caller needs to hold log->lock.
+ */
+static inline size_t skip_gap(struct logger_log *log, size_t pos)
+{
+	return pos == log->compact_to ? log->compact_from : pos;
+}
 
 /*
  * file_get_log - Given a file structure, return the associated log
@@ -88,39 +193,335 @@ static inline struct logger_log *file_get_log(struct file *file)
 }
 
 /*
- * get_entry_header - returns a pointer to the logger_entry header within
- * 'log' starting at offset 'off'. A temporary logger_entry 'scratch' must
- * be provided. Typically the return value will be a pointer within
- * 'logger->buf'.  However, a pointer to 'scratch' may be returned if
- * the log entry spans the end and beginning of the circular buffer.
+ * copy_from_log - copies 'count' bytes at position 'pos' of 'ring' into 'buf',
+ * wrapping around the end of the ring buffer as needed.
+ */
+static void copy_from_log(struct logger_ring *ring, void *buf, size_t pos,
+			  size_t count)
+{
+	size_t off = logger_offset(ring, pos);
+	size_t len = min(count, ring->size - off);
+
+	memcpy(buf, ring->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, ring->buffer, count - len);
+}
+
+/*
+ * copy_to_log - copies 'count' bytes from 'buf' to position 'pos' of 'ring',
+ * wrapping around the end of the ring buffer as needed.
+ */
+static void copy_to_log(struct logger_ring *ring, size_t pos, const void *buf,
+			size_t count)
+{
+	size_t off = logger_offset(ring, pos);
+	size_t len = min(count, ring->size - off);
+
+	memcpy(ring->buffer + off, buf, len);
+	if (count != len)
+		memcpy(ring->buffer, buf + len, count - len);
+}
+
+/*
+ * move_in_log - moves the 'count' bytes at position 'from' of 'ring' down to
+ * position 'to', which must not be after it.
+ */
+static void move_in_log(struct logger_ring *ring, size_t to, size_t from,
+			size_t count)
+{
+	size_t len;
+
+	for (; count; count -= len, to += len, from += len) {
+		len = min3(count, ring->size - logger_offset(ring, to),
+			   ring->size - logger_offset(ring, from));
+		memmove(ring->buffer + logger_offset(ring, to),
+			ring->buffer + logger_offset(ring, from), len);
+	}
+}
+
+/*
+ * copy_ring - copies positions 'pos' up to 'end' of 'from' to the same
+ * positions of 'to'.
  */
-static struct logger_entry *get_entry_header(struct logger_log *log,
-		size_t off, struct logger_entry *scratch)
+static void copy_ring(struct logger_ring *to, struct logger_ring *from,
+		      size_t pos, size_t end)
 {
-	size_t len = min(sizeof(struct logger_entry), log->size - off);
-	if (len != sizeof(struct logger_entry)) {
-		memcpy(((void *) scratch), log->buffer + off, len);
-		memcpy(((void *) scratch) + len, log->buffer,
-			sizeof(struct logger_entry) - len);
-		return scratch;
+	size_t len;
+
+	for (; pos != end; pos += len) {
+		len = min(end - pos, to->size - logger_offset(to, pos));
+		copy_from_log(from, to->buffer + logger_offset(to, pos),
+			      pos, len);
 	}
+}
 
-	return (struct logger_entry *) (log->buffer + off);
+/*
+ * alloc_ring - allocates a ring of 'size' bytes. The buffer is zeroed, since
+ * readers that mmap() the log can see all of it.
+ */
+static struct logger_ring *alloc_ring(size_t size)
+{
+	struct logger_ring *ring;
+
+	ring = kmalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
+	ring->buffer = vzalloc(size);
+	if (!ring->buffer) {
+		kfree(ring);
+		return NULL;
+	}
+	ring->size = size;
+	return ring;
+}
+
+static void free_ring(struct logger_ring *ring)
+{
+	vfree(ring->buffer);
+	kfree(ring);
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
+ * get_uid_usage - returns the usage record of 'euid' in 'log', creating it
+ * if 'create' is set. May return NULL even then if we are out of memory,
+ * in which case the euid's entries simply go unaccounted.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static struct logger_uid_usage *get_uid_usage(struct logger_log *log,
+					      uid_t euid, bool create)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	struct hlist_head *bucket;
+	struct hlist_node *pos;
+	struct logger_uid_usage *usage;
+
+	bucket = &log->uid_usage[hash_32(euid, LOGGER_UID_HASH_BITS)];
+	hlist_for_each_entry(usage, pos, bucket, node)
+		if (usage->euid == euid)
+			return usage;
+
+	if (!create)
+		return NULL;
+
+	usage = kmalloc(sizeof(*usage), GFP_ATOMIC);
+	if (usage) {
+		usage->euid = euid;
+		usage->bytes = 0;
+		usage->oldest = log->w_pos;
+		hlist_add_head(&usage->node, bucket);
+	}
+	return usage;
+}
+
+static void put_uid_usage(struct logger_uid_usage *usage, size_t bytes)
+{
+	usage->bytes -= min(usage->bytes, bytes);
+	if (!usage->bytes) {
+		hlist_del(&usage->node);
+		kfree(usage);
+	}
+}
+
+/*
+ * clear_uid_usage - forgets all usage records of 'log', for when it is
+ * emptied.
+ *
+ * Caller needs to hold log->lock.
+ */
+static void clear_uid_usage(struct logger_log *log)
+{
+	struct hlist_node *pos, *n;
+	struct logger_uid_usage *usage;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(log->uid_usage); i++)
+		hlist_for_each_entry_safe(usage, pos, n, &log->uid_usage[i],
+					  node)
+			put_uid_usage(usage, usage->bytes);
+}
+
+/*
+ * trim_log - retires the oldest entries in 'ring' until no more than 'limit'
+ * bytes of it are in use, by moving the head past them. Readers that still
+ * point at them notice they were lapped. Reaching the compaction gap retires
+ * it as well, and the compaction carries on from the head.
+ *
+ * Caller needs to hold log->lock.
+ */
+static void trim_log(struct logger_log *log, struct logger_ring *ring,
+		     size_t limit)
+{
+	struct logger_entry entry;
+	struct logger_uid_usage *usage;
+
+	while (log->w_pos - log->head > limit) {
+		if (log->head == log->compact_to &&
+		    log->compact_to != log->compact_from) {
+			log->expunged -= log->compact_from - log->compact_to;
+			log->head = log->compact_from;
+			log->compact_to = log->compact_from;
+			continue;
+		}
+
+		copy_from_log(ring, &entry, log->head, sizeof(entry));
+		if (entry.euid == LOGGER_EUID_EXPUNGED) {
+			log->expunged -= sizeof(entry) + entry.len;
+		} else {
+			usage = get_uid_usage(log, entry.euid, false);
+			if (usage)
+				put_uid_usage(usage, sizeof(entry) + entry.len);
+		}
+		log->head += sizeof(entry) + entry.len;
+	}
+}
 
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+/*
+ * expunge_uid - drops the oldest entries of usage->euid from 'ring' until
+ * the euid has no more than 'limit' bytes of entries in 'log'. Their euid is
+ * replaced with LOGGER_EUID_EXPUNGED, so readers skip them, and their space
+ * is reclaimed by the next compact_log(). The scan carries on from where the
+ * last one for this euid stopped, so between compactions it looks at each
+ * entry only once. It looks at no more than LOGGER_EXPUNGE_BATCH entries, so
+ * the euid may stay over 'limit' for a few more writes.
+ *
+ * Caller needs to hold log->lock.
+ */
+static void expunge_uid(struct logger_log *log, struct logger_ring *ring,
+			struct logger_uid_usage *usage, size_t limit)
+{
+	static const uid_t expunged = LOGGER_EUID_EXPUNGED;
+	struct logger_entry entry;
+	size_t pos = usage->oldest;
+	bool changed = false;
+	int scanned;
+
+	if ((long)(pos - log->head) < 0)
+		pos = log->head;
+
+	for (scanned = 0; scanned < LOGGER_EXPUNGE_BATCH; scanned++) {
+		pos = skip_gap(log, pos);
+		if (usage->bytes <= limit || pos == log->w_pos)
+			break;
+
+		copy_from_log(ring, &entry, pos, sizeof(entry));
+		if (entry.euid == usage->euid) {
+			copy_to_log(ring,
+				    pos + offsetof(struct logger_entry, euid),
+				    &expunged, sizeof(expunged));
+			usage->bytes -= min(usage->bytes,
+					    sizeof(entry) + entry.len);
+			log->expunged += sizeof(entry) + entry.len;
+			changed = true;
+		}
+		pos += sizeof(entry) + entry.len;
+	}
+	usage->oldest = pos;
+	if (changed)
+		log->expunges++;
+}
+
+/*
+ * move_positions - moves the readers and expunge scans of 'log' that are at
+ * position 'from' to position 'to'.
+ *
+ * Caller needs to hold log->lock.
+ */
+static void move_positions(struct logger_log *log, size_t from, size_t to)
+{
+	struct logger_reader *reader;
+	struct logger_uid_usage *usage;
+	struct hlist_node *node;
+	int i;
+
+	list_for_each_entry(reader, &log->readers, list)
+		if (reader->r_pos == from)
+			reader->r_pos = to;
+
+	for (i = 0; i < ARRAY_SIZE(log->uid_usage); i++)
+		hlist_for_each_entry(usage, node, &log->uid_usage[i], node)
+			if (usage->oldest == from)
+				usage->oldest = to;
+}
+
+/*
+ * compact_log - reclaims the space of the expunged entries in 'ring' by
+ * moving every newer entry down over them, so that w_pos goes back by the
+ * bytes they took. Readers positioned among the moved entries move with
+ * them. Returns true once the whole log is compacted.
+ *
+ * This goes through LOGGER_COMPACT_BATCH bytes of the log at a time, picking
+ * up at compact_from, and leaves the expunged bytes it went past as the gap
+ * that ends there. Readers that mmap() the log would see the entries move
+ * under them, so it must not be started while the log is mapped.
+ *
+ * Caller needs to hold log->lock.
+ */
+static bool compact_log(struct logger_log *log, struct logger_ring *ring)
+{
+	struct logger_entry entry;
+	size_t from, to, end;
+
+	/* trim_log() retired the gap, and maybe more, since the last batch */
+	if ((long)(log->compact_from - log->head) < 0)
+		log->compact_from = log->compact_to = log->head;
+
+	from = log->compact_from;
+	to = log->compact_to;
+	end = from + LOGGER_COMPACT_BATCH;
+
+	while (1) {
+		if (from != to)
+			move_positions(log, from, to);
+		if (from == log->w_pos || (long)(from - end) >= 0)
+			break;
+
+		copy_from_log(ring, &entry, from, sizeof(entry));
+		if (entry.euid != LOGGER_EUID_EXPUNGED) {
+			if (from != to)
+				move_in_log(ring, to, from,
+					    sizeof(entry) + entry.len);
+			to += sizeof(entry) + entry.len;
+		}
+		from += sizeof(entry) + entry.len;
+	}
+
+	log->compactions++;
+
+	if (from != log->w_pos) {
+		log->compact_from = from;
+		log->compact_to = to;
+		return false;
+	}
+
+	log->expunged -= from - to;
+	log->w_pos = to;
+	log->compact_from = log->compact_to = to;
+	return true;
+}
+
+/*
+ * logger_compact_work - compacts a log whose writers found a good part of it
+ * expunged, letting them have log->lock between batches. It is queued on
+ * system_nrt_wq, so that two compactions of a log never overlap.
+ */
+static void logger_compact_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      compact_work);
+
+	spin_lock(&log->lock);
+	if (atomic_read(&log->mappings) ||
+	    log->expunged < log_ring(log)->size >> LOGGER_COMPACT_SHIFT)
+		goto out;
+
+	log->compact_from = log->compact_to = log->head;
+	while (!compact_log(log, log_ring(log))) {
+		spin_unlock(&log->lock);
+		cond_resched();
+		spin_lock(&log->lock);
+	}
+out:
+	spin_unlock(&log->lock);
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -156,78 +557,92 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * fix_up_reader - pulls 'reader' forward to the oldest entry in 'log' if the
+ * writers lapped it.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
-	size_t len;
-	size_t msg_start;
-
-	/*
-	 * First, copy the header to userspace, using the version of
-	 * the header requested
-	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
-	if (copy_header_to_user(reader->r_ver, entry, buf))
-		return -EFAULT;
-
-	count -= get_user_hdr_len(reader->r_ver);
-	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(reader->r_off + sizeof(struct logger_entry));
-
-	/*
-	 * We read from the msg in two disjoint operations. First, we read from
-	 * the current msg head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - msg_start);
-	if (copy_to_user(buf, log->buffer + msg_start, len))
-		return -EFAULT;
+	if ((long)(reader->r_pos - log->head) < 0)
+		reader->r_pos = log->head;
+}
 
-	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
-	 */
-	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+/*
+ * fetch_entry - returns the next entry readable by 'reader', copied into
+ * reader->entry, or NULL if there is none.
+ *
+ * The entry is copied under log->lock, so writers cannot retire or expunge it
+ * halfway, and r_pos moves past it right away. It stays pending in
+ * reader->entry until do_read_log_to_user() hands it out.  A reader that was
+ * lapped by the writers is pulled forward to the oldest entry in the log.
+ * Entries not readable by the caller's euid, expunged entries and the
+ * compaction gap are skipped.
+ *
+ * Caller must hold reader->mutex.
+ */
+static struct logger_entry *fetch_entry(struct logger_log *log,
+					struct logger_reader *reader)
+{
+	struct logger_entry *entry = reader->entry;
+	struct logger_ring *ring;
+	int skipped = 0;
+
+	if (reader->r_pending)
+		return entry;
+
+	spin_lock(&log->lock);
+	ring = log_ring(log);
+	fix_up_reader(log, reader);
+
+	while ((reader->r_pos = skip_gap(log, reader->r_pos)) != log->w_pos) {
+		copy_from_log(ring, entry, reader->r_pos, sizeof(*entry));
+		if (entry->euid != LOGGER_EUID_EXPUNGED &&
+		    (reader->r_all || entry->euid == current_euid())) {
+			copy_from_log(ring, entry->msg,
+				      reader->r_pos + sizeof(*entry),
+				      entry->len);
+			reader->r_pos += sizeof(*entry) + entry->len;
+			reader->r_pending = true;
+			break;
+		}
+		reader->r_pos += sizeof(*entry) + entry->len;
+
+		/* don't keep writers waiting through a long run of skips */
+		if (++skipped % LOGGER_FETCH_BATCH == 0) {
+			spin_unlock(&log->lock);
+			cond_resched();
+			spin_lock(&log->lock);
+			ring = log_ring(log);
+			fix_up_reader(log, reader);
+		}
+	}
 
-	reader->r_off = logger_offset(reader->r_off +
-		sizeof(struct logger_entry) + count);
+	spin_unlock(&log->lock);
 
-	return count + get_user_hdr_len(reader->r_ver);
+	return reader->r_pending ? entry : NULL;
 }
 
 /*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
+ * do_read_log_to_user - copies 'entry', the entry pending in 'reader', to the
+ * user-space buffer 'buf'. Returns the number of bytes copied on success.
+ *
+ * Caller must hold reader->mutex.
  */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
+static ssize_t do_read_log_to_user(struct logger_reader *reader,
+				   struct logger_entry *entry,
+				   char __user *buf)
 {
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
-
-		entry = get_entry_header(log, off, &scratch);
+	size_t hdr_len = get_user_hdr_len(reader->r_ver);
 
-		if (entry->euid == euid)
-			return off;
+	if (copy_header_to_user(reader->r_ver, entry, buf))
+		return -EFAULT;
+	if (copy_to_user(buf + hdr_len, entry->msg, entry->len))
+		return -EFAULT;
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(off + next_len);
-	}
+	reader->r_pending = false;
 
-	return off;
+	return hdr_len + entry->len;
 }
 
 /*
@@ -237,7 +652,8 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or after LOGGER_SET_BATCH as
+ * 	  many whole entries as fit in the buffer
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -247,6 +663,7 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_entry *entry;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -254,9 +671,8 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		ret = !reader->r_pending &&
+			ACCESS_ONCE(log->w_pos) == ACCESS_ONCE(reader->r_pos);
 		if (!ret)
 			break;
 
@@ -277,204 +693,180 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
-
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+	mutex_lock(&reader->mutex);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	entry = fetch_entry(log, reader);
+	if (unlikely(!entry)) {
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
-
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
-
-out:
-	mutex_unlock(&log->mutex);
-
-	return ret;
-}
-
-/*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
- */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
-{
-	size_t count = 0;
-
+	/* get exactly one entry from the log, or as many as fit if batching */
+	ret = 0;
 	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
-}
+		ssize_t nr;
 
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+		if (count < get_user_hdr_len(reader->r_ver) + entry->len) {
+			if (!ret)
+				ret = -EINVAL;
+			break;
+		}
 
-	return 0;
-}
+		nr = do_read_log_to_user(reader, entry, buf);
+		if (nr < 0) {
+			if (!ret)
+				ret = nr;
+			break;
+		}
 
-/*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
- */
-static void fix_up_readers(struct logger_log *log, size_t len)
-{
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+		buf += nr;
+		count -= nr;
+		ret += nr;
+	} while (reader->r_batch && (entry = fetch_entry(log, reader)));
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	mutex_unlock(&reader->mutex);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	return ret;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes the 'count' byte entry 'entry' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * If the log has a per-uid quota and the new entry would take the writer's
+ * euid over it, the oldest entries of that euid are expunged first. When the
+ * new entry does not fit and enough of the ring is expunged, a compaction is
+ * queued, so that it is the expunged entries that make room for the entries
+ * that follow rather than the oldest entries of other euids. Any entries the
+ * new one overwrites are retired.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log,
+			 const struct logger_entry *entry, size_t count)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
-
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
+	struct logger_ring *ring;
+	struct logger_uid_usage *usage;
+	size_t quota;
+
+	spin_lock(&log->lock);
+	ring = log_ring(log);
+
+	quota = log->uid_quota;
+	usage = get_uid_usage(log, entry->euid, false);
+	if (usage && quota)
+		expunge_uid(log, ring, usage, count >= quota ? 0 : quota - count);
+
+	if (log->w_pos - log->head > ring->size - count &&
+	    log->expunged >= ring->size >> LOGGER_COMPACT_SHIFT &&
+	    !atomic_read(&log->mappings))
+		queue_work(system_nrt_wq, &log->compact_work);
+
+	trim_log(log, ring, ring->size - count);
+	/* the new head must be visible before the old entries are clobbered */
+	smp_wmb();
+
+	/* looked up again, since trim_log() frees the records it empties */
+	usage = get_uid_usage(log, entry->euid, true);
+	copy_to_log(ring, log->w_pos, entry, count);
+	if (usage)
+		usage->bytes += count;
+
+	/* the entry must be visible before readers can see it is there */
+	smp_wmb();
+	log->w_pos += count;
+
+	spin_unlock(&log->lock);
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * copy_iov_from_user - gathers the first 'count' bytes of 'iov' into 'buf'.
+ * If 'atomic' is set this may be called with page faults disabled, and fails
+ * rather than wait for a page that is not present.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int copy_iov_from_user(void *buf, const struct iovec *iov,
+			      size_t count, bool atomic)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (count) {
+		size_t len = min_t(size_t, iov->iov_len, count);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (!access_ok(VERIFY_READ, iov->iov_base, len))
+			return -EFAULT;
+		if (atomic ? __copy_from_user_inatomic(buf, iov->iov_base, len)
+			   : __copy_from_user(buf, iov->iov_base, len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		buf += len;
+		count -= len;
+		iov++;
+	}
 
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is assembled in this cpu's staging buffer and then copied into
+ * the log under log->lock, with preemption disabled throughout; everything
+ * do_write_log() does is bounded by the size of the entry, so this stays
+ * short. Only if the user pages are not resident does it fall back to a
+ * kmalloc()ed buffer, since the copy can then sleep.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	struct logger_entry *entry;
 	struct timespec now;
-	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	bool staged = true;
+	size_t len;
+	int ret;
 
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.euid = current_euid();
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
-	header.hdr_size = sizeof(struct logger_entry);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+	now = current_kernel_time();
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+	preempt_disable();
+	entry = this_cpu_ptr(logger_stage);
+	pagefault_disable();
+	ret = copy_iov_from_user(entry->msg, iov, len, true);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		preempt_enable();
+		staged = false;
+		entry = kmalloc(sizeof(*entry) + len, GFP_KERNEL);
+		if (!entry)
+			return -ENOMEM;
+		if (copy_iov_from_user(entry->msg, iov, len, false)) {
+			kfree(entry);
+			return -EFAULT;
 		}
-
-		iov++;
-		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
+	entry->pid = current->tgid;
+	entry->tid = current->pid;
+	entry->sec = now.tv_sec;
+	entry->nsec = now.tv_nsec;
+	entry->euid = current_euid();
+	entry->len = len;
+	entry->hdr_size = sizeof(struct logger_entry);
+
+	do_write_log(log, entry, sizeof(*entry) + len);
+
+	if (likely(staged))
+		preempt_enable();
+	else
+		kfree(entry);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
-	return ret;
+	return len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -506,15 +898,23 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->r_batch = false;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
-		INIT_LIST_HEAD(&reader->list);
+		reader->entry = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->entry) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
+		mutex_init(&reader->mutex);
+		reader->r_pending = false;
 
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		spin_lock(&log->lock);
+		reader->r_pos = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -532,7 +932,13 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
+
+		kfree(reader->entry);
 		kfree(reader);
 	}
 
@@ -562,14 +968,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	mutex_lock(&reader->mutex);
+	if (fetch_entry(log, reader))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -587,18 +989,125 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+static long logger_set_batch(struct logger_reader *reader, void __user *arg)
+{
+	int batch;
+	if (copy_from_user(&batch, arg, sizeof(int)))
+		return -EFAULT;
+
+	reader->r_batch = batch != 0;
+	return 0;
+}
+
+static long logger_get_positions(struct logger_log *log, void __user *arg)
+{
+	struct logger_positions positions;
+
+	positions.w_pos = ACCESS_ONCE(log->w_pos);
+	/* pairs with the barrier before the update of w_pos */
+	smp_rmb();
+	positions.head = ACCESS_ONCE(log->head);
+
+	if (copy_to_user(arg, &positions, sizeof(positions)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * logger_set_size - replaces the ring of 'log' with one of 'size' bytes,
+ * keeping as many of the newest entries as fit. Positions are unaffected,
+ * so readers carry on where they were unless the shrink lapped them.
+ *
+ * The entries are copied without log->lock, in passes that catch up with
+ * what writers added meanwhile, so that writers only wait for the copy of
+ * the last few entries. A position copied in an earlier pass is still
+ * intact if 'head' has not passed it when the new ring is installed, and
+ * the log was neither compacted nor had entries expunged meanwhile.
+ */
+static long logger_set_size(struct logger_log *log, size_t size)
+{
+	struct logger_ring *ring, *old;
+	size_t done, w_pos;
+	unsigned int compactions, expunges;
+	int pass;
+
+	if (!is_power_of_2(size) || size < LOGGER_MIN_LOG_SIZE ||
+	    size > LOGGER_MAX_LOG_SIZE)
+		return -EINVAL;
+
+	ring = alloc_ring(size);
+	if (!ring)
+		return -ENOMEM;
+
+	mutex_lock(&logger_resize_mutex);
+	old = rcu_dereference_protected(log->ring,
+				lockdep_is_held(&logger_resize_mutex));
+
+	spin_lock(&log->lock);
+	done = log->head;
+	compactions = log->compactions;
+	expunges = log->expunges;
+	spin_unlock(&log->lock);
+
+	for (pass = 0; pass < LOGGER_RESIZE_PASSES; pass++) {
+		if (ACCESS_ONCE(log->compactions) != compactions ||
+		    ACCESS_ONCE(log->expunges) != expunges)
+			break;
+		w_pos = ACCESS_ONCE(log->w_pos);
+		/* pairs with the barrier before the update of w_pos */
+		smp_rmb();
+		if (w_pos - done <= PAGE_SIZE)
+			break;
+		if (w_pos - done > size)
+			done = w_pos - size;
+		copy_ring(ring, old, done, w_pos);
+		done = w_pos;
+		cond_resched();
+	}
+
+	spin_lock(&log->lock);
+
+	/* mappings would keep showing the old buffer */
+	if (atomic_read(&log->mappings)) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&logger_resize_mutex);
+		free_ring(ring);
+		return -EBUSY;
+	}
+
+	trim_log(log, old, size);
+	if (log->compactions != compactions ||
+	    log->expunges != expunges ||
+	    (long)(log->head - done) > 0)
+		done = log->head;
+	copy_ring(ring, old, done, log->w_pos);
+	rcu_assign_pointer(log->ring, ring);
+
+	spin_unlock(&log->lock);
+	mutex_unlock(&logger_resize_mutex);
+
+	printk(KERN_INFO "logger: resized log '%s' to %luK\n",
+	       log->misc.name, (unsigned long) size >> 10);
+
+	synchronize_rcu();
+	free_ring(old);
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
-
-	mutex_lock(&log->mutex);
+	struct logger_entry *entry;
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
-		ret = log->size;
+		rcu_read_lock();
+		ret = rcu_dereference(log->ring)->size;
+		rcu_read_unlock();
 		break;
 	case LOGGER_GET_LOG_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -606,10 +1115,14 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		spin_lock(&log->lock);
+		fix_up_reader(log, reader);
+		ret = log->w_pos - reader->r_pos;
+		spin_unlock(&log->lock);
+		if (reader->r_pending)
+			ret += sizeof(struct logger_entry) + reader->entry->len;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -617,25 +1130,26 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		mutex_lock(&reader->mutex);
+		entry = fetch_entry(log, reader);
+		if (entry)
+			ret = get_user_hdr_len(reader->r_ver) + entry->len;
 		else
 			ret = 0;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* every reader is now behind head and skips to w_pos */
+		spin_lock(&log->lock);
+		log->head = log->w_pos;
+		log->compact_to = log->compact_from = log->w_pos;
+		log->expunged = 0;
+		clear_uid_usage(log);
+		spin_unlock(&log->lock);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -644,7 +1158,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
+		mutex_lock(&reader->mutex);
 		ret = reader->r_ver;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_SET_VERSION:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -652,18 +1168,142 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
+		mutex_lock(&reader->mutex);
 		ret = logger_set_version(reader, argp);
+		mutex_unlock(&reader->mutex);
+		break;
+	case LOGGER_SET_BATCH:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+		ret = logger_set_batch(reader, argp);
+		mutex_unlock(&reader->mutex);
+		break;
+	case LOGGER_GET_POSITIONS:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		ret = logger_get_positions(log, argp);
+		break;
+	case LOGGER_SET_LOG_BUF_SIZE:
+		if (!capable(CAP_SYS_ADMIN)) {
+			ret = -EPERM;
+			break;
+		}
+		ret = logger_set_size(log, arg);
+		break;
+	case LOGGER_SET_UID_QUOTA:
+		if (!capable(CAP_SYS_ADMIN)) {
+			ret = -EPERM;
+			break;
+		}
+		if (arg && arg < LOGGER_ENTRY_MAX_LEN)
+			break;
+		spin_lock(&log->lock);
+		log->uid_quota = arg;
+		spin_unlock(&log->lock);
+		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	return ret;
+}
+
+static void logger_vma_open(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_inc(&log->mappings);
+}
+
+static void logger_vma_close(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_dec(&log->mappings);
+}
+
+static int logger_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct logger_log *log = vma->vm_private_data;
+	struct logger_ring *ring;
+	void *addr;
+	int ret = 0;
+
+	rcu_read_lock();
+	ring = rcu_dereference(log->ring);
+	if (vmf->pgoff >= ring->size >> PAGE_SHIFT) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	addr = ring->buffer + (vmf->pgoff << PAGE_SHIFT);
+	vmf->page = vmalloc_to_page(addr);
+	get_page(vmf->page);
+out:
+	rcu_read_unlock();
 
 	return ret;
 }
 
+static const struct vm_operations_struct logger_vm_ops = {
+	.open = logger_vma_open,
+	.close = logger_vma_close,
+	.fault = logger_vma_fault,
+};
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the ring buffer read-only, so that a reader can parse entries in
+ * place using LOGGER_GET_POSITIONS. The mapping bypasses the per-euid
+ * filtering of read(), so it is only offered to readers that may read
+ * every entry anyway. The log cannot be resized while it is mapped.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+	if (!reader->r_all)
+		return -EPERM;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	spin_lock(&log->lock);
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > log_ring(log)->size) {
+		spin_unlock(&log->lock);
+		return -EINVAL;
+	}
+	atomic_inc(&log->mappings);
+	spin_unlock(&log->lock);
+
+	/* a compaction that already started has to finish first */
+	flush_work(&log->compact_work);
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND;
+	vma->vm_private_data = log;
+	vma->vm_ops = &logger_vm_ops;
+
+	return 0;
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
+	.mmap = logger_mmap,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
@@ -673,14 +1313,12 @@ static const struct file_operations logger_fops = {
 };
 
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * Defines a log structure with name 'NAME'. Its ring is allocated by
+ * init_log(), so that a resize can free it like any other.
  */
-#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+#define DEFINE_LOGGER_DEVICE(VAR, NAME) \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
+	.ring = NULL, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -688,17 +1326,25 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.w_pos = 0, \
 	.head = 0, \
-	.size = SIZE, \
+	.readers = LIST_HEAD_INIT(VAR .readers), \
+	.uid_quota = 0, \
+	.expunged = 0, \
+	.compactions = 0, \
+	.expunges = 0, \
+	.mappings = ATOMIC_INIT(0), \
+	.compact_work = __WORK_INITIALIZER(VAR .compact_work, \
+					   logger_compact_work), \
+	.compact_to = 0, \
+	.compact_from = 0, \
 };
 
-DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
-DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024)
-DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 256*1024)
-DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 256*1024)
+DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN)
+DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS)
+DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO)
+DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM)
 
 static struct logger_log *get_log_from_minor(int minor)
 {
@@ -713,19 +1359,32 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
-static int __init init_log(struct logger_log *log)
+/*
+ * init_log - gives 'log' a ring of 'size' bytes, which must be a power of two
+ * between LOGGER_MIN_LOG_SIZE and LOGGER_MAX_LOG_SIZE, and registers it. This
+ * is only the boot time size; LOGGER_SET_LOG_BUF_SIZE can change it later.
+ */
+static int __init init_log(struct logger_log *log, size_t size)
 {
+	struct logger_ring *ring;
 	int ret;
 
+	ring = alloc_ring(size);
+	if (unlikely(!ring))
+		return -ENOMEM;
+	rcu_assign_pointer(log->ring, ring);
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		rcu_assign_pointer(log->ring, NULL);
+		free_ring(ring);
 		return ret;
 	}
 
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
-	       (unsigned long) log->size >> 10, log->misc.name);
+	       (unsigned long) ring->size >> 10, log->misc.name);
 
 	return 0;
 }
@@ -734,19 +1393,24 @@ static int __init logger_init(void)
 {
 	int ret;
 
-	ret = init_log(&log_main);
+	logger_stage = __alloc_percpu(LOGGER_ENTRY_MAX_LEN,
+				      __alignof__(struct logger_entry));
+	if (unlikely(!logger_stage))
+		return -ENOMEM;
+
+	ret = init_log(&log_main, 256*1024);
 	if (unlikely(ret))
 		goto out;
 
-	ret = init_log(&log_events);
+	ret = init_log(&log_events, 256*1024);
 	if (unlikely(ret))
 		goto out;
 
-	ret = init_log(&log_radio);
+	ret = init_log(&log_radio, 256*1024);
 	if (unlikely(ret))
 		goto out;
 
-	ret = init_log(&log_system);
+	ret = init_log(&log_system, 256*1024);
 	if (unlikely(ret))
 		goto out;
 
@@ -51,6 +51,28 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * Positions returned by LOGGER_GET_POSITIONS, for readers that mmap() the
+ * log.  Both are free-running byte counts; the entry at position 'pos' starts
+ * at offset (pos % buffer size) of the mapping.  Everything from 'head' up
+ * to 'w_pos' is a sequence of complete entries.  An entry that was copied
+ * out of the mapping is only known to be intact if a later
+ * LOGGER_GET_POSITIONS still reports a 'head' at or before it.
+ */
+struct logger_positions {
+	__u32		head;		/* position of the oldest entry */
+	__u32		w_pos;		/* position of the next write */
+};
+
+/*
+ * Entries dropped to keep a euid under its LOGGER_SET_UID_QUOTA get their
+ * euid set to this value, and read() never returns them.  Their space is
+ * reclaimed by moving the newer entries down over them, but not while the
+ * log is mapped: readers that mmap() the log see them until the head passes
+ * them, and should skip them.
+ */
+#define LOGGER_EUID_EXPUNGED	((uid_t) -1)
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -66,5 +88,9 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_SET_BATCH		_IO(__LOGGERIO, 7) /* batched reads */
+#define LOGGER_GET_POSITIONS		_IO(__LOGGERIO, 8) /* for mmap readers */
+#define LOGGER_SET_LOG_BUF_SIZE		_IO(__LOGGERIO, 9) /* resize log */
+#define LOGGER_SET_UID_QUOTA		_IO(__LOGGERIO, 10) /* bytes per uid */
 
 #endif /* _LINUX_LOGGER_H */
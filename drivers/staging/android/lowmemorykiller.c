@@ -16,6 +16,22 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * To correct for this, page reclaim reports how many pages it scanned and
+ * how many it reclaimed. Every pressure_window scanned pages the ratio is
+ * turned into a pressure between 0 and 100 and a level of low, medium
+ * (pressure_medium) or critical (pressure_critical). While reclaim is
+ * critical the page cache is not counted as free. If pressure_low_defer is
+ * set, only the lowest minfree threshold leads to a kill while reclaim is
+ * low, leaving the page cache to reclaim instead. It is off by default,
+ * which keeps every threshold in force.
+ *
+ * Userspace can act before a kill is needed through /dev/lowmem_pressure.
+ * read() blocks until the next medium or critical window, or the first
+ * window after one, and returns "<level> <pressure>". poll() reports when
+ * such a read would not block. Writing "<eventfd> <level>" registers an
+ * eventfd that is signalled at each window of that level or higher, until
+ * the file is closed.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +51,17 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/delay.h>
+#include <linux/eventfd.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -52,8 +79,76 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
-static struct task_struct *lowmem_deathpending;
-static unsigned long lowmem_deathpending_timeout;
+/*
+ * Every process is kept on the list of its oom_adj, so that lowmem_shrink
+ * only looks at the processes it may kill instead of walking the tasklist.
+ * hlist heads are used because the index is live long before lowmem_init.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct hlist_head lowmem_index[LOWMEM_ADJ_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+
+enum lowmem_pressure_level {
+	LOWMEM_PRESSURE_NONE,
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+	LOWMEM_PRESSURE_LEVELS
+};
+
+static const char * const lowmem_pressure_names[LOWMEM_PRESSURE_LEVELS] = {
+	"none",
+	"low",
+	"medium",
+	"critical",
+};
+
+static uint32_t lowmem_pressure_window = SWAP_CLUSTER_MAX * 16;
+static uint32_t lowmem_pressure_medium = 60;
+static uint32_t lowmem_pressure_critical = 95;
+static uint32_t lowmem_pressure_low_defer;
+
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static unsigned long lowmem_pressure_scanned;
+static unsigned long lowmem_pressure_reclaimed;
+static unsigned int lowmem_pressure;
+static enum lowmem_pressure_level lowmem_pressure_level;
+static unsigned long lowmem_pressure_stamp;
+static unsigned int lowmem_pressure_seq;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+
+struct lowmem_event {
+	struct list_head entry;
+	struct file *owner;
+	struct eventfd_ctx *eventfd;
+	enum lowmem_pressure_level level;
+};
+
+static DEFINE_MUTEX(lowmem_event_lock);
+static LIST_HEAD(lowmem_events);
+
+/*
+ * Victims are killed in batches of up to LOWMEM_MAX_VICTIMS and queued for
+ * the reaper thread, which unmaps their private memory without waiting
+ * for them to get through do_exit. No further kills are made while the
+ * queue is not empty, for up to a second.
+ */
+#define LOWMEM_MAX_VICTIMS	4
+#define LOWMEM_REAP_RETRIES	10
+
+struct lowmem_victim {
+	struct task_struct *task;
+	int oom_adj;
+	int tasksize;
+};
+
+static struct task_struct *lowmem_reap_queue[LOWMEM_MAX_VICTIMS];
+static int lowmem_reap_count;
+static unsigned long lowmem_reap_timeout;
+static DEFINE_SPINLOCK(lowmem_reap_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_reap_wait);
+static struct task_struct *lowmem_reaper_thread;
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -61,65 +156,472 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
-static int
-task_notify_func(struct notifier_block *self, unsigned long val, void *data);
+static void lowmem_pressure_notify(struct work_struct *work)
+{
+	struct lowmem_event *event;
+	enum lowmem_pressure_level level;
+
+	spin_lock(&lowmem_pressure_lock);
+	level = lowmem_pressure_level;
+	spin_unlock(&lowmem_pressure_lock);
+
+	mutex_lock(&lowmem_event_lock);
+	list_for_each_entry(event, &lowmem_events, entry)
+		if (level >= event->level)
+			eventfd_signal(event->eventfd, 1);
+	mutex_unlock(&lowmem_event_lock);
+
+	wake_up_interruptible(&lowmem_pressure_wait);
+}
+
+static DECLARE_WORK(lowmem_pressure_work, lowmem_pressure_notify);
+
+void lowmem_reclaim_stat(unsigned long scanned, unsigned long reclaimed)
+{
+	enum lowmem_pressure_level level, prev;
+	unsigned int pressure;
+
+	if (!scanned)
+		return;
+
+	spin_lock(&lowmem_pressure_lock);
+	lowmem_pressure_scanned += scanned;
+	lowmem_pressure_reclaimed += reclaimed;
+	if (lowmem_pressure_scanned < lowmem_pressure_window) {
+		spin_unlock(&lowmem_pressure_lock);
+		return;
+	}
+	reclaimed = min(lowmem_pressure_reclaimed, lowmem_pressure_scanned);
+	pressure = 100 - reclaimed * 100 / lowmem_pressure_scanned;
+	lowmem_pressure_scanned = 0;
+	lowmem_pressure_reclaimed = 0;
+
+	if (pressure >= lowmem_pressure_critical)
+		level = LOWMEM_PRESSURE_CRITICAL;
+	else if (pressure >= lowmem_pressure_medium)
+		level = LOWMEM_PRESSURE_MEDIUM;
+	else
+		level = LOWMEM_PRESSURE_LOW;
+	prev = lowmem_pressure_level;
+	lowmem_pressure = pressure;
+	lowmem_pressure_level = level;
+	lowmem_pressure_stamp = jiffies;
+	/* Low windows are only worth a wakeup when they end an episode. */
+	if (level != LOWMEM_PRESSURE_LOW || prev > LOWMEM_PRESSURE_LOW)
+		lowmem_pressure_seq++;
+	else
+		level = LOWMEM_PRESSURE_NONE;
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (level != LOWMEM_PRESSURE_NONE) {
+		lowmem_print(4, "lowmem pressure %u, %s\n",
+			     pressure, lowmem_pressure_names[level]);
+		schedule_work(&lowmem_pressure_work);
+	}
+}
+
+/* The level of the last window, if reclaim has run in the last second. */
+static enum lowmem_pressure_level lowmem_current_pressure(void)
+{
+	enum lowmem_pressure_level level = LOWMEM_PRESSURE_NONE;
+
+	spin_lock(&lowmem_pressure_lock);
+	if (time_before_eq(jiffies, lowmem_pressure_stamp + HZ))
+		level = lowmem_pressure_level;
+	spin_unlock(&lowmem_pressure_lock);
+	return level;
+}
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)(unsigned long)
+		ACCESS_ONCE(lowmem_pressure_seq);
+	return nonseekable_open(inode, file);
+}
+
+static int lowmem_pressure_release(struct inode *inode, struct file *file)
+{
+	struct lowmem_event *event, *tmp;
+
+	mutex_lock(&lowmem_event_lock);
+	list_for_each_entry_safe(event, tmp, &lowmem_events, entry) {
+		if (event->owner != file)
+			continue;
+		list_del(&event->entry);
+		eventfd_ctx_put(event->eventfd);
+		kfree(event);
+	}
+	mutex_unlock(&lowmem_event_lock);
+	return 0;
+}
+
+static bool lowmem_pressure_pending(struct file *file)
+{
+	return ACCESS_ONCE(lowmem_pressure_seq) !=
+		(unsigned int)(unsigned long)file->private_data;
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	char tmp[32];
+	unsigned int seq;
+	int len;
+	int ret;
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (!lowmem_pressure_pending(file))
+			return -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(lowmem_pressure_wait,
+					       lowmem_pressure_pending(file));
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&lowmem_pressure_lock);
+	seq = lowmem_pressure_seq;
+	len = scnprintf(tmp, sizeof(tmp), "%s %u\n",
+			lowmem_pressure_names[lowmem_pressure_level],
+			lowmem_pressure);
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, tmp, len))
+		return -EFAULT;
+	file->private_data = (void *)(unsigned long)seq;
+	return len;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_pressure_wait, wait);
+	return lowmem_pressure_pending(file) ? POLLIN | POLLRDNORM : 0;
+}
+
+static ssize_t lowmem_pressure_write(struct file *file, const char __user *buf,
+				     size_t count, loff_t *pos)
+{
+	struct lowmem_event *event;
+	char tmp[32];
+	char name[16];
+	int level;
+	int fd;
+
+	if (count >= sizeof(tmp))
+		return -EINVAL;
+	if (copy_from_user(tmp, buf, count))
+		return -EFAULT;
+	tmp[count] = '\0';
+	if (sscanf(tmp, "%d %15s", &fd, name) != 2)
+		return -EINVAL;
+	for (level = LOWMEM_PRESSURE_LOW; level < LOWMEM_PRESSURE_LEVELS; level++)
+		if (!strcmp(name, lowmem_pressure_names[level]))
+			break;
+	if (level == LOWMEM_PRESSURE_LEVELS)
+		return -EINVAL;
+
+	event = kmalloc(sizeof(*event), GFP_KERNEL);
+	if (!event)
+		return -ENOMEM;
+	event->eventfd = eventfd_ctx_fdget(fd);
+	if (IS_ERR(event->eventfd)) {
+		int ret = PTR_ERR(event->eventfd);
+
+		kfree(event);
+		return ret;
+	}
+	event->owner = file;
+	event->level = level;
+
+	mutex_lock(&lowmem_event_lock);
+	list_add_tail(&event->entry, &lowmem_events);
+	mutex_unlock(&lowmem_event_lock);
+	return count;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.release = lowmem_pressure_release,
+	.read = lowmem_pressure_read,
+	.write = lowmem_pressure_write,
+	.poll = lowmem_pressure_poll,
+	.llseek = no_llseek,
+};
 
-static struct notifier_block task_nb = {
-	.notifier_call	= task_notify_func,
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_pressure_fops,
 };
 
-static int
-task_notify_func(struct notifier_block *self, unsigned long val, void *data)
+static struct hlist_head *lowmem_bucket(int oom_adj)
+{
+	return &lowmem_index[clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX) -
+			     OOM_DISABLE];
+}
+
+void lowmem_index_add(struct task_struct *task)
+{
+	spin_lock(&lowmem_index_lock);
+	hlist_add_head(&task->lowmem_node, lowmem_bucket(task->signal->oom_adj));
+	spin_unlock(&lowmem_index_lock);
+}
+
+void lowmem_index_del(struct task_struct *task)
+{
+	spin_lock(&lowmem_index_lock);
+	if (!hlist_unhashed(&task->lowmem_node))
+		hlist_del_init(&task->lowmem_node);
+	spin_unlock(&lowmem_index_lock);
+}
+
+void lowmem_index_update(struct task_struct *task)
+{
+	task = task->group_leader;
+
+	spin_lock(&lowmem_index_lock);
+	if (!hlist_unhashed(&task->lowmem_node)) {
+		hlist_del(&task->lowmem_node);
+		hlist_add_head(&task->lowmem_node,
+			       lowmem_bucket(task->signal->oom_adj));
+	}
+	spin_unlock(&lowmem_index_lock);
+}
+
+/*
+ * Whether a process outside the thread group of task uses mm, as the parent
+ * of a vfork() or a CLONE_VM child does. That process was not killed, so
+ * the memory must be left for it.
+ */
+static bool lowmem_mm_shared(struct task_struct *task, struct mm_struct *mm)
+{
+	struct task_struct *g, *t;
+	bool shared = false;
+
+	/* one user for the victim, one for our get_task_mm() */
+	if (atomic_read(&mm->mm_users) <= 2)
+		return false;
+
+	rcu_read_lock();
+	for_each_process(g) {
+		if (same_thread_group(g, task))
+			continue;
+		t = g;
+		do {
+			struct mm_struct *t_mm = ACCESS_ONCE(t->mm);
+
+			if (t_mm) {
+				shared = t_mm == mm;
+				break;
+			}
+		} while_each_thread(g, t);
+		if (shared)
+			break;
+	}
+	rcu_read_unlock();
+	return shared;
+}
+
+/*
+ * Free the private memory of a killed process. Shared mappings are left
+ * alone, as their pages stay in use elsewhere, and so are mappings that
+ * cannot or must not be zapped. Nothing is reaped if another process
+ * shares the whole mm.
+ */
+static void lowmem_reap_task(struct task_struct *task)
+{
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	int retries;
+
+	mm = get_task_mm(task);
+	if (!mm)
+		return;
+
+	if (lowmem_mm_shared(task, mm)) {
+		lowmem_print(2, "reap %d (%s) skipped, mm is shared\n",
+			     task->pid, task->comm);
+		mmput(mm);
+		return;
+	}
+
+	/*
+	 * The victim may be stuck holding mmap_sem, which is exactly the
+	 * case the reaper is for, so never block on it.
+	 */
+	for (retries = 0; !down_read_trylock(&mm->mmap_sem); retries++) {
+		if (retries == LOWMEM_REAP_RETRIES) {
+			lowmem_print(2, "reap %d (%s) failed, mmap_sem busy\n",
+				     task->pid, task->comm);
+			mmput(mm);
+			return;
+		}
+		msleep(MSEC_PER_SEC / LOWMEM_REAP_RETRIES);
+	}
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (vma->vm_flags & (VM_SHARED | VM_LOCKED | VM_HUGETLB |
+				     VM_SPECIAL))
+			continue;
+		zap_page_range(vma, vma->vm_start, vma->vm_end - vma->vm_start,
+			       NULL);
+	}
+	up_read(&mm->mmap_sem);
+	lowmem_print(3, "reaped %d (%s), rss now %lu\n",
+		     task->pid, task->comm, get_mm_rss(mm));
+	mmput(mm);
+}
+
+static int lowmem_reaper(void *unused)
+{
+	struct task_struct *task;
+	int i;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_reap_wait,
+					 ACCESS_ONCE(lowmem_reap_count) ||
+					 kthread_should_stop());
+
+		spin_lock(&lowmem_reap_lock);
+		task = lowmem_reap_count ? lowmem_reap_queue[0] : NULL;
+		spin_unlock(&lowmem_reap_lock);
+		if (!task)
+			continue;
+
+		lowmem_reap_task(task);
+
+		/* Only the reaper removes entries, so task is still first. */
+		spin_lock(&lowmem_reap_lock);
+		lowmem_reap_count--;
+		for (i = 0; i < lowmem_reap_count; i++)
+			lowmem_reap_queue[i] = lowmem_reap_queue[i + 1];
+		spin_unlock(&lowmem_reap_lock);
+		put_task_struct(task);
+	}
+	return 0;
+}
+
+/*
+ * Kill a selected victim, taking over its task reference. The index lock
+ * was dropped after selection, so the victim may have finished exiting by
+ * now; send_sig() copes with that where force_sig() would not.
+ */
+static void lowmem_kill(struct lowmem_victim *victim)
+{
+	struct task_struct *task = victim->task;
+	bool queued = false;
+
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+		     task->pid, task->comm, victim->oom_adj, victim->tasksize);
+	if (send_sig(SIGKILL, task, 0)) {
+		put_task_struct(task);
+		return;
+	}
+	set_tsk_thread_flag(task, TIF_MEMDIE);
+
+	spin_lock(&lowmem_reap_lock);
+	if (lowmem_reaper_thread && lowmem_reap_count < LOWMEM_MAX_VICTIMS) {
+		lowmem_reap_queue[lowmem_reap_count++] = task;
+		lowmem_reap_timeout = jiffies + HZ;
+		queued = true;
+	}
+	spin_unlock(&lowmem_reap_lock);
+
+	if (!queued)
+		put_task_struct(task);
+}
+
+/*
+ * Insert a candidate into the array of victims, which is kept ordered by
+ * oom_adj and then size, dropping the least suitable one when it is full.
+ */
+static int lowmem_add_victim(struct lowmem_victim *victims, int count,
+			     struct task_struct *p, int oom_adj, int tasksize)
 {
-	struct task_struct *task = data;
+	int i;
+
+	for (i = count; i > 0; i--) {
+		struct lowmem_victim *v = &victims[i - 1];
 
-	if (task == lowmem_deathpending)
-		lowmem_deathpending = NULL;
+		if (oom_adj < v->oom_adj ||
+		    (oom_adj == v->oom_adj && tasksize <= v->tasksize))
+			break;
+		if (i < LOWMEM_MAX_VICTIMS)
+			victims[i] = *v;
+	}
+	if (i == LOWMEM_MAX_VICTIMS)
+		return count;
 
-	return NOTIFY_OK;
+	victims[i].task = p;
+	victims[i].oom_adj = oom_adj;
+	victims[i].tasksize = tasksize;
+	lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+		     p->pid, p->comm, oom_adj, tasksize);
+	return count < LOWMEM_MAX_VICTIMS ? count + 1 : count;
 }
 
 static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
-	struct task_struct *selected = NULL;
+	struct hlist_node *pos;
+	struct lowmem_victim victims[LOWMEM_MAX_VICTIMS];
+	int nr_victims = 0;
+	int selected_size = 0;
 	int rem = 0;
 	int tasksize;
 	int i;
+	int adj;
 	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
+	int deficit = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
+	enum lowmem_pressure_level pressure = lowmem_current_pressure();
 
 	/*
-	 * If we already have a death outstanding, then
+	 * If we already have victims waiting to be reaped, then
 	 * bail out right away; indicating to vmscan
 	 * that we have nothing further to offer on
 	 * this pass.
 	 *
 	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+	if (ACCESS_ONCE(lowmem_reap_count) &&
+	    time_before_eq(jiffies, lowmem_reap_timeout))
 		return 0;
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
+
+	/*
+	 * Reclaim failing on nearly everything it scans means the page
+	 * cache left is not really free.
+	 */
+	if (pressure == LOWMEM_PRESSURE_CRITICAL)
+		other_file = 0;
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
+			/*
+			 * Reclaim is still keeping up, so leave it the
+			 * page cache unless free memory is at the bottom.
+			 */
+			if (lowmem_pressure_low_defer &&
+			    pressure == LOWMEM_PRESSURE_LOW && i > 0)
+				break;
 			min_adj = lowmem_adj[i];
+			deficit = lowmem_minfree[i] - other_free;
 			break;
 		}
 	}
 	if (nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
+		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d, %s\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
-			     min_adj);
+			     min_adj, lowmem_pressure_names[pressure]);
 	rem = global_page_state(NR_ACTIVE_ANON) +
 		global_page_state(NR_ACTIVE_FILE) +
 		global_page_state(NR_INACTIVE_ANON) +
@@ -129,55 +631,65 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
+	/*
+	 * Buckets are walked from the highest oom_adj down until the victims
+	 * found cover the deficit to the minfree threshold that was crossed.
+	 * A process whose oom_adj was just written may still sit in its old
+	 * bucket, so the checks below use its current oom_adj.  Every oom_adj
+	 * below OOM_DISABLE shares the lowest bucket, which is walked once.
+	 */
+	spin_lock(&lowmem_index_lock);
+	for (adj = OOM_ADJUST_MAX; adj >= max(min_adj, OOM_DISABLE); adj--) {
+		if (nr_victims && selected_size >= deficit)
+			break;
+		hlist_for_each_entry(p, pos, lowmem_bucket(adj), lowmem_node) {
+			struct mm_struct *mm;
+			struct signal_struct *sig;
+			int oom_adj;
 
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+			task_lock(p);
+			mm = p->mm;
+			sig = p->signal;
+			if (!mm || !sig) {
+				task_unlock(p);
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			}
+			oom_adj = sig->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			if (tasksize <= 0 ||
+			    test_tsk_thread_flag(p, TIF_MEMDIE))
 				continue;
+			nr_victims = lowmem_add_victim(victims, nr_victims, p,
+						       oom_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
+		for (i = 0, selected_size = 0; i < nr_victims; i++)
+			selected_size += victims[i].tasksize;
+	}
+
+	/* Only kill as many of the best victims as the deficit needs. */
+	for (i = 0, selected_size = 0; i < nr_victims; i++) {
+		if (i && selected_size >= deficit)
+			break;
+		selected_size += victims[i].tasksize;
+		get_task_struct(victims[i].task);
+	}
+	nr_victims = i;
+	spin_unlock(&lowmem_index_lock);
+
+	for (i = 0; i < nr_victims; i++)
+		lowmem_kill(&victims[i]);
+	if (nr_victims) {
+		wake_up(&lowmem_reap_wait);
+		rem -= selected_size;
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -188,15 +700,36 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
-	task_free_register(&task_nb);
+	struct task_struct *reaper;
+	int ret;
+
+	ret = misc_register(&lowmem_pressure_misc);
+	if (ret)
+		return ret;
+
+	/* Without the reaper victims still free their memory as they exit. */
+	reaper = kthread_run(lowmem_reaper, NULL, "lowmemreaper");
+	if (IS_ERR(reaper))
+		pr_err("lowmemorykiller: failed to start reaper, %ld\n",
+		       PTR_ERR(reaper));
+	else
+		lowmem_reaper_thread = reaper;
+
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	int i;
+
 	unregister_shrinker(&lowmem_shrinker);
-	task_free_unregister(&task_nb);
+	if (lowmem_reaper_thread)
+		kthread_stop(lowmem_reaper_thread);
+	for (i = 0; i < lowmem_reap_count; i++)
+		put_task_struct(lowmem_reap_queue[i]);
+	misc_deregister(&lowmem_pressure_misc);
+	cancel_work_sync(&lowmem_pressure_work);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,6 +738,14 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_window, lowmem_pressure_window, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium, lowmem_pressure_medium, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_low_defer, lowmem_pressure_low_defer, uint,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -26,6 +26,11 @@
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
 #include <linux/rslib.h>
 #endif
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED
+#include <linux/lzo.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#endif
 
 struct ram_console_buffer {
 	uint32_t    sig;
@@ -36,6 +41,51 @@ struct ram_console_buffer {
 
 #define RAM_CONSOLE_SIG (0x43474244) /* DBGC */
 
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED
+/*
+ * With compression enabled the region holds binary records instead of
+ * text.  Records are appended to the uncompressed stage[] block, and a
+ * full stage is LZO-compressed into a ring of blocks in data[].  ECC is
+ * only computed when a block is written to the ring, so a printk costs a
+ * memcpy into stage[].  stage[] itself is not ECC protected.
+ *
+ * head is the offset of the oldest block in the ring and tail the offset
+ * the next one is written at.  A block with clen 0, or too little room
+ * left for a block header, means the ring continues at offset 0.
+ */
+struct ram_console_zbuffer {
+	uint32_t    sig;
+	uint32_t    head;
+	uint32_t    tail;
+	uint32_t    blocks;
+	uint32_t    pending;	/* bytes used in stage[] */
+	uint8_t     stage[CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED_BLOCK_SIZE];
+	uint8_t     data[0];	/* blocks are stored at 4 byte aligned offsets */
+};
+
+struct ram_console_zblock {
+	uint16_t    clen;	/* compressed size of data[] */
+	uint16_t    rlen;	/* size of the records once decompressed */
+	uint8_t     data[0];
+};
+
+struct ram_console_record {
+	uint32_t    sec;
+	uint32_t    usec;
+	uint16_t    len;	/* bytes of text following the record */
+	uint8_t     level;
+	uint8_t     cpu;
+};
+
+#define RAM_CONSOLE_ZSIG (0x5a474244) /* DBGZ */
+#define ZBLOCK_SIZE CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED_BLOCK_SIZE
+#define ZBLOCK_MAX ALIGN(sizeof(struct ram_console_zblock) + \
+			 lzo1x_worst_compress(ZBLOCK_SIZE), 4)
+/* the record continues the previous line, it carries no time or level */
+#define RAM_CONSOLE_REC_CONT (0x80)
+#define RAM_CONSOLE_REC_LEVEL (0x07)
+#endif
+
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_EARLY_INIT
 static char __initdata
 	ram_console_old_log_init_buffer[CONFIG_ANDROID_RAM_CONSOLE_EARLY_SIZE];
@@ -43,7 +93,9 @@ static char __initdata
 static char *ram_console_old_log;
 static size_t ram_console_old_log_size;
 
+#ifndef CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED
 static struct ram_console_buffer *ram_console_buffer;
+#endif
 static size_t ram_console_buffer_size;
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
 static char *ram_console_par_buffer;
@@ -55,6 +107,13 @@ static int ram_console_bad_blocks;
 #define ECC_SYMSIZE CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION_SYMBOL_SIZE
 #define ECC_POLY CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION_POLYNOMIAL
 #endif
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED
+static struct ram_console_zbuffer *ram_console_zbuffer;
+static void *ram_console_zwrkmem;
+static uint8_t *ram_console_zout;
+static bool ram_console_zline_start = true;
+static int ram_console_zbad_blocks;
+#endif
 
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
 static void ram_console_encode_rs8(uint8_t *data, size_t len, uint8_t *ecc)
@@ -77,46 +136,234 @@ static int ram_console_decode_rs8(void *data, size_t len, uint8_t *ecc)
 	return decode_rs8(ram_console_rs_decoder, data, par, len,
 				NULL, 0, NULL, 0, NULL);
 }
-#endif
 
-static void ram_console_update(const char *s, unsigned int count)
+/* Re-encode the ECC blocks covering data[start] to data[start + count - 1] */
+static void ram_console_encode_range(uint8_t *data, size_t start, size_t count)
 {
-	struct ram_console_buffer *buffer = ram_console_buffer;
-#ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
-	uint8_t *buffer_end = buffer->data + ram_console_buffer_size;
+	uint8_t *buffer_end = data + ram_console_buffer_size;
 	uint8_t *block;
 	uint8_t *par;
 	int size = ECC_BLOCK_SIZE;
-#endif
-	memcpy(buffer->data + buffer->start, s, count);
-#ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
-	block = buffer->data + (buffer->start & ~(ECC_BLOCK_SIZE - 1));
-	par = ram_console_par_buffer +
-	      (buffer->start / ECC_BLOCK_SIZE) * ECC_SIZE;
+
+	block = data + (start & ~(ECC_BLOCK_SIZE - 1));
+	par = ram_console_par_buffer + (start / ECC_BLOCK_SIZE) * ECC_SIZE;
 	do {
 		if (block + ECC_BLOCK_SIZE > buffer_end)
 			size = buffer_end - block;
 		ram_console_encode_rs8(block, size, par);
 		block += ECC_BLOCK_SIZE;
 		par += ECC_SIZE;
-	} while (block < buffer->data + buffer->start + count);
+	} while (block < data + start + count);
+}
+
+/* Correct the ECC blocks covering data[start] to data[start + count - 1] */
+static void __init
+ram_console_decode_range(uint8_t *data, size_t start, size_t count)
+{
+	uint8_t *block = data + (start & ~(ECC_BLOCK_SIZE - 1));
+	uint8_t *par = ram_console_par_buffer +
+		       (start / ECC_BLOCK_SIZE) * ECC_SIZE;
+
+	while (block < data + start + count) {
+		int numerr;
+		int size = ECC_BLOCK_SIZE;
+		if (block + size > data + ram_console_buffer_size)
+			size = data + ram_console_buffer_size - block;
+		numerr = ram_console_decode_rs8(block, size, par);
+		if (numerr > 0) {
+#if 0
+			printk(KERN_INFO "ram_console: error in block %p, %d\n",
+			       block, numerr);
+#endif
+			ram_console_corrected_bytes += numerr;
+		} else if (numerr < 0) {
+#if 0
+			printk(KERN_INFO "ram_console: uncorrectable error in "
+			       "block %p\n", block);
+#endif
+			ram_console_bad_blocks++;
+		}
+		block += ECC_BLOCK_SIZE;
+		par += ECC_SIZE;
+	}
+}
+#endif
+
+#ifndef CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED
+static void ram_console_update(const char *s, unsigned int count)
+{
+	struct ram_console_buffer *buffer = ram_console_buffer;
+	memcpy(buffer->data + buffer->start, s, count);
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
+	ram_console_encode_range(buffer->data, buffer->start, count);
 #endif
 }
+#endif
 
-static void ram_console_update_header(void)
+static void ram_console_update_header(void *header, size_t size)
 {
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
-	struct ram_console_buffer *buffer = ram_console_buffer;
 	uint8_t *par;
 	par = ram_console_par_buffer +
 	      DIV_ROUND_UP(ram_console_buffer_size, ECC_BLOCK_SIZE) * ECC_SIZE;
-	ram_console_encode_rs8((uint8_t *)buffer, sizeof(*buffer), par);
+	ram_console_encode_rs8(header, size, par);
+#endif
+}
+
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED
+/*
+ * Drop the blocks at the head of the ring that overlap data[off] to
+ * data[off + len - 1], which is about to be overwritten.
+ */
+static void ram_console_zevict(uint32_t off, uint32_t len)
+{
+	struct ram_console_zbuffer *buffer = ram_console_zbuffer;
+	struct ram_console_zblock *block;
+
+	while (buffer->blocks &&
+	       buffer->head >= off && buffer->head < off + len) {
+		block = (void *)(buffer->data + buffer->head);
+		buffer->head += ALIGN(sizeof(*block) + block->clen, 4);
+		if (!--buffer->blocks)
+			break;
+		block = (void *)(buffer->data + buffer->head);
+		if (buffer->head + sizeof(*block) > ram_console_buffer_size ||
+		    !block->clen)
+			buffer->head = 0;
+	}
+	if (!buffer->blocks)
+		buffer->head = off;
+}
+
+/* Compress the staged records into the next block of the ring */
+static void ram_console_zflush(void)
+{
+	struct ram_console_zbuffer *buffer = ram_console_zbuffer;
+	struct ram_console_zblock *block;
+	size_t clen;
+	uint32_t off = buffer->tail;
+	uint32_t len;
+
+	if (lzo1x_1_compress(buffer->stage, buffer->pending, ram_console_zout,
+			     &clen, ram_console_zwrkmem) != LZO_E_OK) {
+		buffer->pending = 0;
+		return;
+	}
+	len = ALIGN(sizeof(*block) + clen, 4);
+
+	if (off + len > ram_console_buffer_size) {
+		ram_console_zevict(off, ram_console_buffer_size - off);
+		if (off + sizeof(*block) <= ram_console_buffer_size) {
+			block = (void *)(buffer->data + off);
+			block->clen = 0;
+			block->rlen = 0;
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
+			ram_console_encode_range(buffer->data, off,
+						 sizeof(*block));
+#endif
+		}
+		off = 0;
+	}
+	ram_console_zevict(off, len);
+
+	block = (void *)(buffer->data + off);
+	block->clen = clen;
+	block->rlen = buffer->pending;
+	memcpy(block->data, ram_console_zout, clen);
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
+	ram_console_encode_range(buffer->data, off, len);
 #endif
+	buffer->tail = off + len;
+	buffer->blocks++;
+	ram_console_update_header(buffer,
+		offsetof(struct ram_console_zbuffer, pending));
+	buffer->pending = 0;
 }
 
+/*
+ * Parse the "[%5lu.%06lu] " prefix printk puts on each line when
+ * printk.time is set, and strip it from the text.
+ */
+static bool ram_console_zparse_time(const char **s, unsigned int *count,
+				    uint32_t *sec, uint32_t *usec)
+{
+	const char *p = *s;
+	const char *end = *s + *count;
+	uint32_t val = 0;
+	int digits = 0;
+
+	if (p == end || *p++ != '[')
+		return false;
+	while (p < end && *p == ' ')
+		p++;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		val = val * 10 + *p - '0';
+	if (p == end || *p++ != '.')
+		return false;
+	*sec = val;
+
+	val = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		val = val * 10 + *p - '0';
+	if (digits != 6 || end - p < 2 || p[0] != ']' || p[1] != ' ')
+		return false;
+	*usec = val;
+
+	*count -= p + 2 - *s;
+	*s = p + 2;
+	return true;
+}
+
+static void ram_console_zrecord(const char *s, unsigned int count)
+{
+	struct ram_console_zbuffer *buffer = ram_console_zbuffer;
+	struct ram_console_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	if (!ram_console_zline_start) {
+		rec.level = RAM_CONSOLE_REC_CONT;
+	} else {
+		if (!ram_console_zparse_time(&s, &count, &rec.sec, &rec.usec)) {
+			unsigned long long t = local_clock();
+			rec.usec = do_div(t, NSEC_PER_SEC) / NSEC_PER_USEC;
+			rec.sec = t;
+		}
+		rec.level = console_msg_level & RAM_CONSOLE_REC_LEVEL;
+	}
+	rec.cpu = raw_smp_processor_id();
+
+	if (count > ZBLOCK_SIZE - sizeof(rec))
+		count = ZBLOCK_SIZE - sizeof(rec);
+	rec.len = count;
+
+	if (buffer->pending + sizeof(rec) + count > ZBLOCK_SIZE)
+		ram_console_zflush();
+	memcpy(buffer->stage + buffer->pending, &rec, sizeof(rec));
+	memcpy(buffer->stage + buffer->pending + sizeof(rec), s, count);
+	buffer->pending += sizeof(rec) + count;
+}
+
+/* Store each line of the console output as its own record */
+static void ram_console_zwrite(const char *s, unsigned int count)
+{
+	while (count) {
+		const char *nl = memchr(s, '\n', count);
+		unsigned int len = nl ? nl - s + 1 : count;
+
+		ram_console_zrecord(s, len);
+		ram_console_zline_start = nl != NULL;
+		s += len;
+		count -= len;
+	}
+}
+#endif
+
 static void
 ram_console_write(struct console *console, const char *s, unsigned int count)
 {
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED
+	ram_console_zwrite(s, count);
+#else
 	int rem;
 	struct ram_console_buffer *buffer = ram_console_buffer;
 
@@ -137,7 +384,8 @@ ram_console_write(struct console *console, const char *s, unsigned int count)
 	buffer->start += count;
 	if (buffer->size < ram_console_buffer_size)
 		buffer->size += count;
-	ram_console_update_header();
+	ram_console_update_header(buffer, sizeof(*buffer));
+#endif
 }
 
 static struct console ram_console = {
@@ -155,6 +403,58 @@ void ram_console_enable_console(int enabled)
 		ram_console.flags &= ~CON_ENABLED;
 }
 
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
+/*
+ * Carve the parity out of the end of the data area and correct the
+ * header in place.
+ */
+static int __init ram_console_init_ecc(void *header, size_t header_size,
+				       uint8_t *data, size_t buffer_size)
+{
+	int numerr;
+	uint8_t *par;
+
+	ram_console_buffer_size -= (DIV_ROUND_UP(ram_console_buffer_size,
+						ECC_BLOCK_SIZE) + 1) * ECC_SIZE;
+
+	if (ram_console_buffer_size > buffer_size) {
+		pr_err("ram_console: buffer %p, invalid size %zu, "
+		       "non-ecc datasize %zu\n",
+		       header, buffer_size, ram_console_buffer_size);
+		return -1;
+	}
+
+	ram_console_par_buffer = data + ram_console_buffer_size;
+
+	/* first consecutive root is 0
+	 * primitive element to generate roots = 1
+	 */
+	ram_console_rs_decoder = init_rs(ECC_SYMSIZE, ECC_POLY, 0, 1, ECC_SIZE);
+	if (ram_console_rs_decoder == NULL) {
+		printk(KERN_INFO "ram_console: init_rs failed\n");
+		return -1;
+	}
+
+	ram_console_corrected_bytes = 0;
+	ram_console_bad_blocks = 0;
+
+	par = ram_console_par_buffer +
+	      DIV_ROUND_UP(ram_console_buffer_size, ECC_BLOCK_SIZE) * ECC_SIZE;
+
+	numerr = ram_console_decode_rs8(header, header_size, par);
+	if (numerr > 0) {
+		printk(KERN_INFO "ram_console: error in header, %d\n", numerr);
+		ram_console_corrected_bytes += numerr;
+	} else if (numerr < 0) {
+		printk(KERN_INFO
+		       "ram_console: uncorrectable error in header\n");
+		ram_console_bad_blocks++;
+	}
+	return 0;
+}
+#endif
+
+#ifndef CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED
 static void __init
 ram_console_save_old(struct ram_console_buffer *buffer, const char *bootinfo,
 	char *dest)
@@ -166,35 +466,10 @@ ram_console_save_old(struct ram_console_buffer *buffer, const char *bootinfo,
 	const char *bootinfo_label = "Boot info:\n";
 
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
-	uint8_t *block;
-	uint8_t *par;
 	char strbuf[80];
 	int strbuf_len = 0;
 
-	block = buffer->data;
-	par = ram_console_par_buffer;
-	while (block < buffer->data + buffer->size) {
-		int numerr;
-		int size = ECC_BLOCK_SIZE;
-		if (block + size > buffer->data + ram_console_buffer_size)
-			size = buffer->data + ram_console_buffer_size - block;
-		numerr = ram_console_decode_rs8(block, size, par);
-		if (numerr > 0) {
-#if 0
-			printk(KERN_INFO "ram_console: error in block %p, %d\n",
-			       block, numerr);
-#endif
-			ram_console_corrected_bytes += numerr;
-		} else if (numerr < 0) {
-#if 0
-			printk(KERN_INFO "ram_console: uncorrectable error in "
-			       "block %p\n", block);
-#endif
-			ram_console_bad_blocks++;
-		}
-		block += ECC_BLOCK_SIZE;
-		par += ECC_SIZE;
-	}
+	ram_console_decode_range(buffer->data, 0, buffer->size);
 	if (ram_console_corrected_bytes || ram_console_bad_blocks)
 		strbuf_len = snprintf(strbuf, sizeof(strbuf),
 			"\n%d Corrected bytes, %d unrecoverable blocks\n",
@@ -234,22 +509,209 @@ ram_console_save_old(struct ram_console_buffer *buffer, const char *bootinfo,
 	if (bootinfo) {
 		memcpy(ptr, bootinfo_label, strlen(bootinfo_label));
 		ptr += strlen(bootinfo_label);
-		memcpy(ptr, bootinfo, bootinfo_size);
-		ptr += bootinfo_size;
+		memcpy(ptr, bootinfo, strlen(bootinfo));
+		ptr += strlen(bootinfo);
 	}
 }
+#endif
 
-static int __init ram_console_init(struct ram_console_buffer *buffer,
-				   size_t buffer_size, const char *bootinfo,
-				   char *old_buf)
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED
+/*
+ * Format a run of records as text.  With dest == NULL only the size of
+ * the text is returned.
+ */
+static size_t __init
+ram_console_zrender(const uint8_t *raw, size_t size, char *dest)
+{
+	struct ram_console_record rec;
+	size_t pos = 0;
+	size_t len = 0;
+	char prefix[48];
+	int prefix_len;
+
+	while (pos + sizeof(rec) <= size) {
+		memcpy(&rec, raw + pos, sizeof(rec));
+		pos += sizeof(rec);
+		if (rec.len > size - pos)
+			break;
+		if (!(rec.level & RAM_CONSOLE_REC_CONT)) {
+			prefix_len = scnprintf(prefix, sizeof(prefix),
+				"<%u>[%5u.%06u] c%u ",
+				rec.level & RAM_CONSOLE_REC_LEVEL,
+				rec.sec, rec.usec, rec.cpu);
+			if (dest)
+				memcpy(dest + len, prefix, prefix_len);
+			len += prefix_len;
+		}
+		if (dest)
+			memcpy(dest + len, raw + pos, rec.len);
+		len += rec.len;
+		pos += rec.len;
+	}
+	return len;
+}
+
+/* Decompress the ring from oldest to newest, then the staged records */
+static size_t __init
+ram_console_zwalk(struct ram_console_zbuffer *buffer, uint8_t *raw, char *dest)
 {
+	struct ram_console_zblock *block;
+	uint32_t off = buffer->head;
+	size_t len = 0;
+	size_t rlen;
+	int i;
+
+	ram_console_zbad_blocks = 0;
+	for (i = 0; i < buffer->blocks; i++) {
+		block = (void *)(buffer->data + off);
+		if (off + sizeof(*block) > ram_console_buffer_size ||
+		    !block->clen) {
+			off = 0;
+			block = (void *)buffer->data;
+		}
+		if (block->clen > ram_console_buffer_size - off - sizeof(*block)) {
+			ram_console_zbad_blocks += buffer->blocks - i;
+			break;
+		}
+		rlen = ZBLOCK_SIZE;
+		if (lzo1x_decompress_safe(block->data, block->clen,
+					  raw, &rlen) != LZO_E_OK ||
+		    rlen != block->rlen)
+			ram_console_zbad_blocks++;
+		else
+			len += ram_console_zrender(raw, rlen,
+						   dest ? dest + len : NULL);
+		off += ALIGN(sizeof(*block) + block->clen, 4);
+	}
+	if (buffer->pending <= ZBLOCK_SIZE)
+		len += ram_console_zrender(buffer->stage, buffer->pending,
+					   dest ? dest + len : NULL);
+	return len;
+}
+
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
-	int numerr;
-	uint8_t *par;
+/*
+ * Correct the ECC blocks from *done up to data[end - 1], but not at or past
+ * limit, and move *done past them.
+ */
+static void __init
+ram_console_zdecode_to(uint8_t *data, size_t *done, size_t end, size_t limit)
+{
+	end = min(end, limit);
+	if (end <= *done)
+		return;
+	ram_console_decode_range(data, *done, end - *done);
+	*done = ALIGN(end, ECC_BLOCK_SIZE);
+}
+
+/*
+ * Correct only the parts of the ring that hold blocks, following the block
+ * headers from the head, since the rest may never have been encoded. An ECC
+ * block shared by two ring blocks is decoded once, so that its errors are
+ * not counted twice.
+ */
+static void __init ram_console_zdecode(struct ram_console_zbuffer *buffer)
+{
+	struct ram_console_zblock *block;
+	uint32_t off = buffer->head;
+	size_t done = off & ~(ECC_BLOCK_SIZE - 1);
+	size_t limit = ram_console_buffer_size;
+	int i;
+
+	for (i = 0; i < buffer->blocks; i++) {
+		block = (void *)(buffer->data + off);
+		if (off + sizeof(*block) <= ram_console_buffer_size)
+			ram_console_zdecode_to(buffer->data, &done,
+					       off + sizeof(*block), limit);
+		if (off + sizeof(*block) > ram_console_buffer_size ||
+		    !block->clen) {
+			/* the ECC block holding the head was decoded first */
+			limit = buffer->head & ~(ECC_BLOCK_SIZE - 1);
+			off = 0;
+			done = 0;
+			block = (void *)buffer->data;
+			ram_console_zdecode_to(buffer->data, &done,
+					       sizeof(*block), limit);
+		}
+		if (block->clen > ram_console_buffer_size - off - sizeof(*block))
+			break;
+		off += ALIGN(sizeof(*block) + block->clen, 4);
+		ram_console_zdecode_to(buffer->data, &done, off, limit);
+	}
+}
 #endif
-	ram_console_buffer = buffer;
+
+static void __init
+ram_console_zsave_old(struct ram_console_zbuffer *buffer, const char *bootinfo)
+{
+	size_t old_log_size;
+	size_t bootinfo_size = 0;
+	size_t total_size;
+	uint8_t *raw;
+	char *ptr;
+	const char *bootinfo_label = "Boot info:\n";
+	char strbuf[80];
+	int strbuf_len = 0;
+
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
+	ram_console_zdecode(buffer);
+#endif
+	raw = kmalloc(ZBLOCK_SIZE, GFP_KERNEL);
+	if (raw == NULL) {
+		printk(KERN_ERR "ram_console: failed to allocate buffer\n");
+		return;
+	}
+	old_log_size = ram_console_zwalk(buffer, raw, NULL);
+
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
+	if (ram_console_corrected_bytes || ram_console_bad_blocks)
+		strbuf_len = snprintf(strbuf, sizeof(strbuf),
+			"\n%d Corrected bytes, %d unrecoverable blocks\n",
+			ram_console_corrected_bytes, ram_console_bad_blocks);
+	else
+		strbuf_len = snprintf(strbuf, sizeof(strbuf),
+				      "\nNo errors detected\n");
+	if (strbuf_len >= sizeof(strbuf))
+		strbuf_len = sizeof(strbuf) - 1;
+#endif
+	if (ram_console_zbad_blocks)
+		strbuf_len += scnprintf(strbuf + strbuf_len,
+			sizeof(strbuf) - strbuf_len,
+			"%d corrupt compressed blocks\n",
+			ram_console_zbad_blocks);
+
+	if (bootinfo)
+		bootinfo_size = strlen(bootinfo) + strlen(bootinfo_label);
+	total_size = old_log_size + strbuf_len + bootinfo_size;
+
+	ram_console_old_log = kmalloc(total_size, GFP_KERNEL);
+	if (ram_console_old_log == NULL) {
+		printk(KERN_ERR "ram_console: failed to allocate buffer\n");
+		kfree(raw);
+		return;
+	}
+	ram_console_old_log_size = total_size;
+	ram_console_zwalk(buffer, raw, ram_console_old_log);
+	kfree(raw);
+
+	ptr = ram_console_old_log + old_log_size;
+	memcpy(ptr, strbuf, strbuf_len);
+	ptr += strbuf_len;
+	if (bootinfo) {
+		memcpy(ptr, bootinfo_label, strlen(bootinfo_label));
+		ptr += strlen(bootinfo_label);
+		memcpy(ptr, bootinfo, strlen(bootinfo));
+	}
+}
+
+static int __init ram_console_zinit(struct ram_console_buffer *mem,
+				    size_t buffer_size, const char *bootinfo)
+{
+	struct ram_console_zbuffer *buffer = (void *)mem;
+
+	ram_console_zbuffer = buffer;
 	ram_console_buffer_size =
-		buffer_size - sizeof(struct ram_console_buffer);
+		buffer_size - sizeof(struct ram_console_zbuffer);
 
 	if (ram_console_buffer_size > buffer_size) {
 		pr_err("ram_console: buffer %p, invalid size %zu, "
@@ -259,43 +721,86 @@ static int __init ram_console_init(struct ram_console_buffer *buffer,
 	}
 
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
-	ram_console_buffer_size -= (DIV_ROUND_UP(ram_console_buffer_size,
-						ECC_BLOCK_SIZE) + 1) * ECC_SIZE;
-
-	if (ram_console_buffer_size > buffer_size) {
-		pr_err("ram_console: buffer %p, invalid size %zu, "
-		       "non-ecc datasize %zu\n",
-		       buffer, buffer_size, ram_console_buffer_size);
+	if (ram_console_init_ecc(buffer,
+				 offsetof(struct ram_console_zbuffer, pending),
+				 buffer->data, buffer_size))
+		return 0;
+#endif
+	if (ram_console_buffer_size < 2 * ZBLOCK_MAX) {
+		pr_err("ram_console: buffer %p, size %zu too small for "
+		       "%d byte compressed blocks\n", buffer, buffer_size,
+		       ZBLOCK_SIZE);
 		return 0;
 	}
 
-	ram_console_par_buffer = buffer->data + ram_console_buffer_size;
-
-
-	/* first consecutive root is 0
-	 * primitive element to generate roots = 1
-	 */
-	ram_console_rs_decoder = init_rs(ECC_SYMSIZE, ECC_POLY, 0, 1, ECC_SIZE);
-	if (ram_console_rs_decoder == NULL) {
-		printk(KERN_INFO "ram_console: init_rs failed\n");
+	ram_console_zwrkmem = kmalloc(LZO1X_1_MEM_COMPRESS, GFP_KERNEL);
+	ram_console_zout = kmalloc(lzo1x_worst_compress(ZBLOCK_SIZE),
+				   GFP_KERNEL);
+	if (!ram_console_zwrkmem || !ram_console_zout) {
+		printk(KERN_ERR "ram_console: failed to allocate buffer\n");
+		kfree(ram_console_zwrkmem);
+		kfree(ram_console_zout);
 		return 0;
 	}
 
-	ram_console_corrected_bytes = 0;
-	ram_console_bad_blocks = 0;
+	if (buffer->sig == RAM_CONSOLE_ZSIG) {
+		if (buffer->head >= ram_console_buffer_size ||
+		    buffer->tail > ram_console_buffer_size ||
+		    (buffer->head | buffer->tail) & 3 ||
+		    buffer->blocks > ram_console_buffer_size /
+				     sizeof(struct ram_console_zblock))
+			printk(KERN_INFO "ram_console: found existing invalid "
+			       "buffer, head %d, tail %d, blocks %d\n",
+			       buffer->head, buffer->tail, buffer->blocks);
+		else {
+			printk(KERN_INFO "ram_console: found existing buffer, "
+			       "%d blocks, %d bytes staged\n",
+			       buffer->blocks, buffer->pending);
+			ram_console_zsave_old(buffer, bootinfo);
+		}
+	} else {
+		printk(KERN_INFO "ram_console: no valid data in buffer "
+		       "(sig = 0x%08x)\n", buffer->sig);
+	}
 
-	par = ram_console_par_buffer +
-	      DIV_ROUND_UP(ram_console_buffer_size, ECC_BLOCK_SIZE) * ECC_SIZE;
+	buffer->sig = RAM_CONSOLE_ZSIG;
+	buffer->head = 0;
+	buffer->tail = 0;
+	buffer->blocks = 0;
+	buffer->pending = 0;
+	ram_console_update_header(buffer,
+		offsetof(struct ram_console_zbuffer, pending));
 
-	numerr = ram_console_decode_rs8(buffer, sizeof(*buffer), par);
-	if (numerr > 0) {
-		printk(KERN_INFO "ram_console: error in header, %d\n", numerr);
-		ram_console_corrected_bytes += numerr;
-	} else if (numerr < 0) {
-		printk(KERN_INFO
-		       "ram_console: uncorrectable error in header\n");
-		ram_console_bad_blocks++;
+	register_console(&ram_console);
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_ENABLE_VERBOSE
+	console_verbose();
+#endif
+	return 0;
+}
+#endif
+
+static int __init ram_console_init(struct ram_console_buffer *buffer,
+				   size_t buffer_size, const char *bootinfo,
+				   char *old_buf)
+{
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_COMPRESSED
+	return ram_console_zinit(buffer, buffer_size, bootinfo);
+#else
+	ram_console_buffer = buffer;
+	ram_console_buffer_size =
+		buffer_size - sizeof(struct ram_console_buffer);
+
+	if (ram_console_buffer_size > buffer_size) {
+		pr_err("ram_console: buffer %p, invalid size %zu, "
+		       "datasize %zu\n", buffer, buffer_size,
+		       ram_console_buffer_size);
+		return 0;
 	}
+
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
+	if (ram_console_init_ecc(buffer, sizeof(*buffer), buffer->data,
+				 buffer_size))
+		return 0;
 #endif
 
 	if (buffer->sig == RAM_CONSOLE_SIG) {
@@ -324,6 +829,7 @@ static int __init ram_console_init(struct ram_console_buffer *buffer,
 	console_verbose();
 #endif
 	return 0;
+#endif
 }
 
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_EARLY_INIT
@@ -35,6 +35,7 @@
 
 #include "nvmap.h"
 #include "nvmap_mru.h"
+#include "nvmap_trace.h"
 
 /* private nvmap_handle flag for pinning duplicate detection */
 #define NVMAP_HANDLE_VISITED (0x1ul << 31)
@@ -66,9 +67,16 @@ static void map_iovmm_area(struct nvmap_handle *h)
 static int pin_locked(struct nvmap_client *client, struct nvmap_handle *h)
 {
 	struct tegra_iovmm_area *area;
+	int pin;
 	BUG_ON(!h->alloc);
 
-	if (atomic_inc_return(&h->pin) == 1) {
+	/* a carveout handle may be being moved by the compactor; the base
+	 * address is stable once the pin count is raised */
+	nvmap_carveout_lock(h);
+	pin = atomic_inc_return(&h->pin);
+	nvmap_carveout_unlock(h);
+
+	if (pin == 1) {
 		if (h->heap_pgalloc && !h->pgalloc.contig) {
 			area = nvmap_handle_iovmm(client, h);
 			if (!area) {
@@ -99,22 +107,60 @@ static int wait_pin_locked(struct nvmap_client *client, struct nvmap_handle *h)
 
 }
 
-/* doesn't need to be called inside nvmap_pin_lock, since this will only
- * expand the available VM area */
-static int handle_unpin(struct nvmap_client *client, struct nvmap_handle *h)
+/* pins the handles in h, inside the pin lock. handles which are already
+ * pinned, or whose IOVMM area is still cached on the MRU lists, are pinned
+ * under a single acquisition of the MRU lock; it is only dropped for the
+ * handles which need pin_locked to find IOVMM space or to stabilize a
+ * carveout. *pinned is set to the number of handles pinned */
+static int pin_array_locked(struct nvmap_client *client,
+			    struct nvmap_handle **h, int nr, int *pinned)
 {
+	bool locked = false;
 	int ret = 0;
+	int i;
 
-	nvmap_mru_lock(client->share);
+	for (i = 0; i < nr; i++) {
+		if (!locked) {
+			nvmap_mru_lock(client->share);
+			locked = true;
+		}
 
+		if (h[i]->heap_pgalloc && h[i]->pgalloc.contig) {
+			atomic_inc(&h[i]->pin);
+		} else if (!h[i]->heap_pgalloc ||
+			   !nvmap_mru_pin_cached_locked(client->share, h[i])) {
+			nvmap_mru_unlock(client->share);
+			locked = false;
+
+			ret = wait_pin_locked(client, h[i]);
+			if (ret)
+				break;
+		}
+
+		trace_nvmap_pin(client, h[i]);
+	}
+
+	if (locked)
+		nvmap_mru_unlock(client->share);
+
+	*pinned = i;
+	return ret;
+}
+
+/* drops a pin on h; returns 1 if the handle was unpinned and its IOVMM space
+ * may be reclaimed, or a negative value if h wasn't pinned. the caller must
+ * hold the MRU lock, and put the handle unless h wasn't pinned */
+static int handle_unpin_locked(struct nvmap_client *client,
+			       struct nvmap_handle *h)
+{
 	if (atomic_read(&h->pin) == 0) {
 		nvmap_err(client, "%s unpinning unpinned handle %p\n",
 			  current->group_leader->comm, h);
-		nvmap_mru_unlock(client->share);
-		return 0;
+		return -EINVAL;
 	}
 
 	BUG_ON(!h->alloc);
+	trace_nvmap_unpin(client, h);
 
 	if (!atomic_dec_return(&h->pin)) {
 		if (h->heap_pgalloc && h->pgalloc.area) {
@@ -125,16 +171,62 @@ static int handle_unpin(struct nvmap_client *client, struct nvmap_handle *h)
 				h->pgalloc.dirty = true;
 			}
 			nvmap_mru_insert_locked(client->share, h);
-			ret = 1;
+			return 1;
 		}
 	}
 
+	return 0;
+}
+
+/* doesn't need to be called inside nvmap_pin_lock, since this will only
+ * expand the available VM area */
+static int handle_unpin(struct nvmap_client *client, struct nvmap_handle *h)
+{
+	int ret;
+
+	nvmap_mru_lock(client->share);
+	ret = handle_unpin_locked(client, h);
 	nvmap_mru_unlock(client->share);
 
+	if (ret < 0)
+		return 0;
+
 	nvmap_handle_put(h);
 	return ret;
 }
 
+/* unpins the handles in h under a single acquisition of the MRU lock */
+static int handle_unpin_array(struct nvmap_client *client,
+			      struct nvmap_handle **h, int nr)
+{
+	int do_wake = 0;
+	int i;
+
+	nvmap_mru_lock(client->share);
+	for (i = 0; i < nr; i++) {
+		int ret;
+
+		if (WARN_ON(!h[i]))
+			continue;
+
+		ret = handle_unpin_locked(client, h[i]);
+		if (ret < 0)
+			continue;
+		do_wake |= ret;
+
+		/* freeing the handle takes the MRU lock, so the last
+		 * reference must be dropped outside of it */
+		if (!atomic_add_unless(&h[i]->ref, -1, 1)) {
+			nvmap_mru_unlock(client->share);
+			nvmap_handle_put(h[i]);
+			nvmap_mru_lock(client->share);
+		}
+	}
+	nvmap_mru_unlock(client->share);
+
+	return do_wake;
+}
+
 static int handle_unpin_noref(struct nvmap_client *client, unsigned long id)
 {
 	struct nvmap_handle *h;
@@ -248,18 +340,11 @@ int nvmap_pin_ids(struct nvmap_client *client,
 	if (WARN_ON(ret))
 		goto out;
 
-	for (cnt = 0; cnt < nr && !ret; cnt++) {
-		ret = wait_pin_locked(client, h[cnt]);
-	}
+	ret = pin_array_locked(client, h, nr, &cnt);
 	mutex_unlock(&client->share->pin_lock);
 
 	if (ret) {
-		int do_wake = 0;
-
-		for (i = 0; i < cnt; i++)
-			do_wake |= handle_unpin(client, h[i]);
-
-		if (do_wake)
+		if (handle_unpin_array(client, h, cnt))
 			wake_up(&client->share->pin_wait);
 
 		ret = -EINTR;
@@ -362,6 +447,7 @@ static int nvmap_reloc_pin_array(struct nvmap_client *client,
 			last_patch = patch;
 		}
 
+		nvmap_carveout_lock(patch);
 		if (patch->heap_pgalloc) {
 			unsigned int page = arr[i].patch_offset >> PAGE_SHIFT;
 			phys = page_to_phys(patch->pgalloc.pages[page]);
@@ -381,6 +467,8 @@ static int nvmap_reloc_pin_array(struct nvmap_client *client,
 
 		reloc_addr = handle_phys(pin) + arr[i].pin_offset;
 		__raw_writel(reloc_addr, addr + (phys & ~PAGE_MASK));
+		nvmap_handle_mark_dirty(patch);
+		nvmap_carveout_unlock(patch);
 	}
 
 	nvmap_free_pte(client->dev, pte);
@@ -397,6 +485,7 @@ static int nvmap_validate_get_pin_array(struct nvmap_client *client,
 					const struct nvmap_pinarray_elem *arr,
 					int nr, struct nvmap_handle **h)
 {
+	struct nvmap_handle_ref *last = NULL;
 	int i;
 	int ret = 0;
 	int count = 0;
@@ -410,8 +499,14 @@ static int nvmap_validate_get_pin_array(struct nvmap_client *client,
 			nvmap_ref_unlock(client);
 			schedule();
 			nvmap_ref_lock(client);
+			last = NULL;
 		}
 
+		/* consecutive relocations usually target the same handle;
+		 * it was validated and visited for the previous entry */
+		if (last && arr[i].pin_mem == (unsigned long)last->handle)
+			continue;
+
 		ref = _nvmap_validate_id_locked(client, arr[i].pin_mem);
 
 		if (!ref)
@@ -432,6 +527,8 @@ static int nvmap_validate_get_pin_array(struct nvmap_client *client,
 		 * are dedicated to storing unpin lists, which allows
 		 * for greater parallelism between the CPU and graphics
 		 * processor */
+		last = ref;
+
 		if (ref->handle->flags & NVMAP_HANDLE_VISITED)
 			continue;
 
@@ -506,8 +603,7 @@ int nvmap_pin_array(struct nvmap_client *client, struct nvmap_handle *gather,
 	for (i = 0; i < count; i++)
 		unique_arr[i]->flags &= ~NVMAP_HANDLE_VISITED;
 
-	for (pinned = 0; pinned < count && !ret; pinned++)
-		ret = wait_pin_locked(client, unique_arr[pinned]);
+	ret = pin_array_locked(client, unique_arr, count, &pinned);
 
 	mutex_unlock(&client->share->pin_lock);
 
@@ -515,15 +611,10 @@ int nvmap_pin_array(struct nvmap_client *client, struct nvmap_handle *gather,
 		ret = nvmap_reloc_pin_array(client, arr, nr, gather);
 
 	if (WARN_ON(ret)) {
-		int do_wake = 0;
-
 		for (i = pinned; i < count; i++)
 			nvmap_handle_put(unique_arr[i]);
 
-		for (i = 0; i < pinned; i++)
-			do_wake |= handle_unpin(client, unique_arr[i]);
-
-		if (do_wake)
+		if (handle_unpin_array(client, unique_arr, pinned))
 			wake_up(&client->share->pin_wait);
 
 		return ret;
@@ -556,6 +647,8 @@ unsigned long nvmap_pin(struct nvmap_client *client,
 	} else {
 		ret = wait_pin_locked(client, h);
 		mutex_unlock(&client->share->pin_lock);
+		if (!ret)
+			trace_nvmap_pin(client, h);
 	}
 
 	if (ret) {
@@ -595,16 +688,7 @@ void nvmap_unpin(struct nvmap_client *client, struct nvmap_handle_ref *ref)
 void nvmap_unpin_handles(struct nvmap_client *client,
 			 struct nvmap_handle **h, int nr)
 {
-	int i;
-	int do_wake = 0;
-
-	for (i = 0; i < nr; i++) {
-		if (WARN_ON(!h[i]))
-			continue;
-		do_wake |= handle_unpin(client, h[i]);
-	}
-
-	if (do_wake)
+	if (handle_unpin_array(client, h, nr))
 		wake_up(&client->share->pin_wait);
 }
 
@@ -623,17 +707,33 @@ void *nvmap_mmap(struct nvmap_handle_ref *ref)
 
 	prot = nvmap_pgprot(h, pgprot_kernel);
 
-	if (h->heap_pgalloc)
-		return vm_map_ram(h->pgalloc.pages, h->size >> PAGE_SHIFT,
-				  -1, prot);
+	/* the compactor won't move the handle while the mapping exists */
+	nvmap_carveout_lock(h);
+	atomic_inc(&h->kmaps);
+	nvmap_carveout_unlock(h);
+	nvmap_handle_mark_dirty(h);
+
+	if (h->heap_pgalloc) {
+		p = vm_map_ram(h->pgalloc.pages, h->size >> PAGE_SHIFT,
+			       -1, prot);
+		if (!p) {
+			atomic_dec(&h->kmaps);
+			nvmap_handle_put(h);
+		} else {
+			trace_nvmap_mmap(NULL, h);
+		}
+		return p;
+	}
 
 	/* carveout - explicitly map the pfns into a vmalloc area */
+
 	adj_size = h->carveout->base & ~PAGE_MASK;
 	adj_size += h->size;
 	adj_size = PAGE_ALIGN(adj_size);
 
 	v = alloc_vm_area(adj_size);
 	if (!v) {
+		atomic_dec(&h->kmaps);
 		nvmap_handle_put(h);
 		return NULL;
 	}
@@ -665,10 +765,13 @@ void *nvmap_mmap(struct nvmap_handle_ref *ref)
 
 	if (offs != adj_size) {
 		free_vm_area(v);
+		atomic_dec(&h->kmaps);
 		nvmap_handle_put(h);
 		return NULL;
 	}
 
+	trace_nvmap_mmap(NULL, h);
+
 	/* leave the handle ref count incremented by 1, so that
 	 * the handle will not be freed while the kernel mapping exists.
 	 * nvmap_handle_put will be called by unmapping this address */
@@ -693,6 +796,7 @@ void nvmap_munmap(struct nvmap_handle_ref *ref, void *addr)
 		BUG_ON(!vm);
 	}
 
+	atomic_dec(&h->kmaps);
 	nvmap_handle_put(h);
 }
 
@@ -747,6 +851,7 @@ int nvmap_patch_wait(struct nvmap_client *client,
 		return PTR_ERR(pte);
 
 	/* derive physaddr of cmdbuf WAIT to patch */
+	nvmap_carveout_lock(patch);
 	if (patch->heap_pgalloc) {
 		unsigned int page = patch_offset >> PAGE_SHIFT;
 		phys = page_to_phys(patch->pgalloc.pages[page]);
@@ -768,6 +873,8 @@ int nvmap_patch_wait(struct nvmap_client *client,
 
 	/* write patch_value to addr + page offset */
 	__raw_writel(patch_value, addr + (phys & ~PAGE_MASK));
+	nvmap_handle_mark_dirty(patch);
+	nvmap_carveout_unlock(patch);
 
 	nvmap_free_pte(client->dev, pte);
 	wmb();
@@ -24,8 +24,11 @@
 #define __VIDEO_TEGRA_NVMAP_NVMAP_H
 
 #include <linux/list.h>
+#include <linux/mm.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/wait.h>
 
@@ -49,6 +52,12 @@
 
 #define nvmap_ref_to_id(_ref)		((unsigned long)(_ref)->handle)
 
+#ifdef CONFIG_NVMAP_HIGHMEM_ONLY
+#define GFP_NVMAP		(__GFP_HIGHMEM | __GFP_NOWARN)
+#else
+#define GFP_NVMAP		(GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
+#endif
+
 struct nvmap_device;
 struct page;
 struct tegra_iovmm_area;
@@ -64,7 +73,8 @@ struct nvmap_pgalloc {
 };
 
 struct nvmap_handle {
-	struct rb_node node;	/* entry on global handle tree */
+	struct hlist_node node;	/* entry on global handle hash */
+	struct rcu_head rcu;	/* frees the handle after RCU lookups */
 	atomic_t ref;		/* reference count (i.e., # of duplications) */
 	atomic_t pin;		/* pin count */
 	unsigned long flags;
@@ -80,8 +90,31 @@ struct nvmap_handle {
 	bool secure;		/* zap IOVMM area on unpin */
 	bool heap_pgalloc;	/* handle is page allocated (sysmem / iovmm) */
 	bool alloc;		/* handle has memory allocated */
+	bool cpu_dirty;		/* CPU may hold dirty lines for the handle */
+	atomic_t kmaps;		/* kernel mappings (nvmap_mmap) */
 	struct mutex lock;
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	struct rw_semaphore carveout_sem; /* held by the compactor to move */
+	struct mutex umap_lock;
+	struct list_head umap_list;	/* nvmap_vma_priv of the user VMAs */
+#endif
+};
+
+#ifdef CONFIG_NVMAP_PAGE_POOLS
+#define NVMAP_NUM_POOLS		(NVMAP_HANDLE_CACHE_FLAG + 1)
+
+/* pages on a pool have no dirty lines in L1 or L2, so they can be handed
+ * to a handle of any cache attribute without further maintenance. pages
+ * freed from cacheable handles wait on the dirty list until the pool
+ * thread has cleaned them */
+struct nvmap_page_pool {
+	struct list_head pages;		/* clean pages, linked by page->lru */
+	struct list_head dirty;		/* freed pages waiting to be cleaned */
+	unsigned int npages;
+	unsigned int ndirty;
+	bool want_fill;			/* pool dropped below the low mark */
 };
+#endif
 
 struct nvmap_share {
 	struct tegra_iovmm_client *iovmm;
@@ -92,6 +125,12 @@ struct nvmap_share {
 	struct list_head *mru_lists;
 	int nr_mru;
 #endif
+#ifdef CONFIG_NVMAP_PAGE_POOLS
+	spinlock_t pool_lock;
+	struct nvmap_page_pool pools[NVMAP_NUM_POOLS];
+	struct task_struct *pool_thread;
+	struct shrinker pool_shrinker;
+#endif
 };
 
 struct nvmap_carveout_commit {
@@ -106,6 +145,8 @@ struct nvmap_client {
 	struct rb_root			handle_refs;
 	atomic_t			iovm_commit;
 	size_t				iovm_limit;
+	atomic_t			sysmem_commit;
+	struct list_head		list;	/* entry on device client list */
 	spinlock_t			ref_lock;
 	bool				super;
 	atomic_t			count;
@@ -128,6 +169,11 @@ struct nvmap_vma_priv {
 	struct nvmap_handle *handle;
 	size_t		offs;
 	atomic_t	count;	/* number of processes cloning the VMA */
+	unsigned long	pgoff;	/* start of the mmap's window of page offsets */
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	unsigned long	pages;	/* size of the window */
+	struct list_head umap_entry;	/* entry on handle->umap_list */
+#endif
 };
 
 static inline void nvmap_ref_lock(struct nvmap_client *priv)
@@ -149,12 +195,12 @@ pte_t **nvmap_alloc_pte_irq(struct nvmap_device *dev, void **vaddr);
 void nvmap_free_pte(struct nvmap_device *dev, pte_t **pte);
 
 struct nvmap_heap_block *nvmap_carveout_alloc(struct nvmap_client *dev,
+					      struct nvmap_handle *handle,
 					      size_t len, size_t align,
 					      unsigned long usage,
 					      unsigned int prot);
 
-unsigned long nvmap_carveout_usage(struct nvmap_client *c,
-				   struct nvmap_heap_block *b);
+unsigned int nvmap_handle_heap(struct nvmap_handle *h);
 
 struct nvmap_carveout_node;
 void nvmap_carveout_commit_add(struct nvmap_client *client,
@@ -233,6 +279,71 @@ static inline pgprot_t nvmap_pgprot(struct nvmap_handle *h, pgprot_t prot)
 	return prot;
 }
 
+/* cpu_dirty is set when a kernel mapping is created, when a user mapping
+ * is faulted in, and after nvmap's own writes through temporary PTEs
+ * (NVMAP_IOC_WRITE, relocation and wait patching). a handle the CPU has
+ * never written holds no dirty lines, so its write backs are skipped. it
+ * is never cleared, since user space can write through a mapping that has
+ * already been faulted in without nvmap knowing */
+static inline void nvmap_handle_mark_dirty(struct nvmap_handle *h)
+{
+	h->cpu_dirty = true;
+}
+
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+/* the compactor moves the carveout of an unpinned handle while holding
+ * carveout_sem for writing; code that uses the base address of a handle
+ * that it hasn't pinned must hold carveout_sem for reading. handles with
+ * kernel mappings are never moved. */
+static inline void nvmap_carveout_lock(struct nvmap_handle *h)
+{
+	down_read(&h->carveout_sem);
+}
+
+static inline int nvmap_carveout_trylock(struct nvmap_handle *h)
+{
+	return down_read_trylock(&h->carveout_sem);
+}
+
+static inline void nvmap_carveout_unlock(struct nvmap_handle *h)
+{
+	up_read(&h->carveout_sem);
+}
+
+/* the user VMAs of a handle are listed so that the compactor can zap just
+ * their windows when it moves the handle. a VMA is listed before it is
+ * bound to the handle, so it can't be faulted in while unlisted */
+static inline void nvmap_umap_add(struct nvmap_handle *h,
+				  struct nvmap_vma_priv *priv)
+{
+	mutex_lock(&h->umap_lock);
+	list_add(&priv->umap_entry, &h->umap_list);
+	mutex_unlock(&h->umap_lock);
+}
+
+static inline void nvmap_umap_del(struct nvmap_handle *h,
+				  struct nvmap_vma_priv *priv)
+{
+	mutex_lock(&h->umap_lock);
+	list_del(&priv->umap_entry);
+	mutex_unlock(&h->umap_lock);
+}
+
+void nvmap_carveout_compact_schedule(struct nvmap_device *dev);
+
+#else
+
+#define nvmap_carveout_lock(_h)			do { } while (0)
+#define nvmap_carveout_trylock(_h)		1
+#define nvmap_carveout_unlock(_h)		do { } while (0)
+#define nvmap_umap_add(_h, _priv)		do { } while (0)
+#define nvmap_umap_del(_h, _priv)		do { } while (0)
+#define nvmap_carveout_compact_schedule(_d)	do { } while (0)
+
+#endif
+
 int is_nvmap_vma(struct vm_area_struct *vma);
 
+extern void __flush_dcache_page(struct address_space *, struct page *);
+
 #endif
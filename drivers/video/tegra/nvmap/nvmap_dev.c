@@ -24,16 +24,19 @@
 #include <linux/bitmap.h>
 #include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/hash.h>
 #include <linux/kernel.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/oom.h>
 #include <linux/platform_device.h>
+#include <linux/rculist.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include <asm/cacheflush.h>
 #include <asm/tlbflush.h>
@@ -44,8 +47,13 @@
 #include "nvmap.h"
 #include "nvmap_ioctl.h"
 #include "nvmap_mru.h"
+#include "nvmap_pool.h"
+
+#define CREATE_TRACE_POINTS
+#include "nvmap_trace.h"
 
 #define NVMAP_NUM_PTES		64
+#define NVMAP_HANDLE_HASH_BITS	8
 #define NVMAP_CARVEOUT_KILLER_RETRY_TIME 100 /* msecs */
 
 #ifdef CONFIG_NVMAP_CARVEOUT_KILLER
@@ -55,6 +63,13 @@ static bool carveout_killer;
 #endif
 module_param(carveout_killer, bool, 0640);
 
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+/* delay after a carveout free before the heaps are compacted in the
+ * background; 0 disables background compaction */
+static unsigned int carveout_compact_delay = 1000; /* msecs */
+module_param(carveout_compact_delay, uint, 0644);
+#endif
+
 struct nvmap_carveout_node {
 	unsigned int		heap_bit;
 	struct nvmap_heap	*carveout;
@@ -70,7 +85,8 @@ struct nvmap_device {
 	unsigned int	lastpte;
 	spinlock_t	ptelock;
 
-	struct rb_root	handles;
+	/* handles are looked up under RCU; handle_lock serializes updates */
+	struct hlist_head handles[1 << NVMAP_HANDLE_HASH_BITS];
 	spinlock_t	handle_lock;
 	wait_queue_head_t pte_wait;
 	struct miscdevice dev_super;
@@ -78,6 +94,12 @@ struct nvmap_device {
 	struct nvmap_carveout_node *heaps;
 	int nr_carveouts;
 	struct nvmap_share iovmm_master;
+	struct list_head clients;
+	spinlock_t	clients_lock;
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	struct inode *dev_inode;	/* owns the mapping of all nvmap files */
+	struct delayed_work compact_work;
+#endif
 };
 
 struct nvmap_device *nvmap_dev;
@@ -235,19 +257,19 @@ struct nvmap_handle *nvmap_get_handle_id(struct nvmap_client *client,
 	return h;
 }
 
-unsigned long nvmap_carveout_usage(struct nvmap_client *c,
-				   struct nvmap_heap_block *b)
+/* returns the NVMAP_HEAP_* bit of the heap that h is allocated from */
+unsigned int nvmap_handle_heap(struct nvmap_handle *h)
 {
-	struct nvmap_heap *h = nvmap_block_to_heap(b);
-	struct nvmap_carveout_node *n;
-	int i;
+	struct nvmap_carveout_node *node;
 
-	for (i = 0; i < c->dev->nr_carveouts; i++) {
-		n = &c->dev->heaps[i];
-		if (n->carveout == h)
-			return n->heap_bit;
-	}
-	return 0;
+	if (!h->alloc)
+		return 0;
+
+	if (h->heap_pgalloc)
+		return h->pgalloc.contig ? NVMAP_HEAP_SYSMEM : NVMAP_HEAP_IOVMM;
+
+	node = nvmap_heap_to_arg(nvmap_block_to_heap(h->carveout));
+	return node->heap_bit;
 }
 
 static int nvmap_flush_heap_block(struct nvmap_client *client,
@@ -401,7 +423,193 @@ out:
 	return wait;
 }
 
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+/* user mappings of carveout handles point straight at the carveout, so the
+ * compactor has to tear them down before it moves a handle; nvmap_vma_fault
+ * maps the new location on the next access. every nvmap file shares the
+ * address space of the first nvmap inode opened, and every mmap gets its
+ * own window of page offsets in it, so that unmap_mapping_range can zap
+ * the VMAs of one handle in every process. */
+static unsigned long nvmap_next_pgoff;
+static DEFINE_SPINLOCK(nvmap_pgoff_lock);
+
+static unsigned long nvmap_alloc_pgoff(unsigned long pages)
+{
+	unsigned long pgoff;
+
+	spin_lock(&nvmap_pgoff_lock);
+	if (nvmap_next_pgoff + pages < nvmap_next_pgoff)
+		nvmap_next_pgoff = 0;
+	pgoff = nvmap_next_pgoff;
+	nvmap_next_pgoff += pages;
+	spin_unlock(&nvmap_pgoff_lock);
+	return pgoff;
+}
+
+static void nvmap_zap_umaps(struct nvmap_device *dev, struct nvmap_handle *h)
+{
+	struct nvmap_vma_priv *priv;
+
+	mutex_lock(&h->umap_lock);
+	list_for_each_entry(priv, &h->umap_list, umap_entry)
+		unmap_mapping_range(dev->dev_inode->i_mapping,
+				    (loff_t)priv->pgoff << PAGE_SHIFT,
+				    (loff_t)priv->pages << PAGE_SHIFT, 1);
+	mutex_unlock(&h->umap_lock);
+}
+
+static void nvmap_share_mapping(struct nvmap_device *dev, struct inode *inode,
+				struct file *filp)
+{
+	if (!dev->dev_inode) {
+		struct inode *held = igrab(inode);
+
+		if (WARN_ON(!held))
+			return;
+		if (cmpxchg(&dev->dev_inode, NULL, held))
+			iput(held);
+	}
+	filp->f_mapping = dev->dev_inode->i_mapping;
+}
+
+/* copies len bytes of carveout memory from src to dst, using the cache
+ * attributes of handle h. the compactor holds the heap lock, so it doesn't
+ * wait for PTEs to become free */
+static int nvmap_carveout_copy(struct nvmap_device *dev,
+			       struct nvmap_handle *h, unsigned long dst,
+			       unsigned long src, size_t len)
+{
+	pgprot_t prot = nvmap_pgprot(h, pgprot_kernel);
+	pte_t **src_pte;
+	pte_t **dst_pte;
+	void *src_addr;
+	void *dst_addr;
+
+	src_pte = nvmap_alloc_pte_irq(dev, &src_addr);
+	if (IS_ERR(src_pte))
+		return PTR_ERR(src_pte);
+
+	dst_pte = nvmap_alloc_pte_irq(dev, &dst_addr);
+	if (IS_ERR(dst_pte)) {
+		nvmap_free_pte(dev, src_pte);
+		return PTR_ERR(dst_pte);
+	}
+
+	while (len) {
+		unsigned long skaddr = (unsigned long)src_addr;
+		unsigned long dkaddr = (unsigned long)dst_addr;
+		size_t count;
+		void *to;
+
+		count = min_t(size_t, PAGE_SIZE - (src & ~PAGE_MASK),
+			      PAGE_SIZE - (dst & ~PAGE_MASK));
+		count = min(count, len);
+
+		set_pte_at(&init_mm, skaddr, *src_pte,
+			   pfn_pte(__phys_to_pfn(src), prot));
+		flush_tlb_kernel_page(skaddr);
+		set_pte_at(&init_mm, dkaddr, *dst_pte,
+			   pfn_pte(__phys_to_pfn(dst), prot));
+		flush_tlb_kernel_page(dkaddr);
+
+		to = dst_addr + (dst & ~PAGE_MASK);
+		memcpy(to, src_addr + (src & ~PAGE_MASK), count);
+
+		/* devices must see the data at the new location even if
+		 * the owner already did its cache maintenance */
+		if (h->flags == NVMAP_HANDLE_CACHEABLE ||
+		    h->flags == NVMAP_HANDLE_INNER_CACHEABLE)
+			__cpuc_flush_dcache_area(to, count);
+		if (h->flags == NVMAP_HANDLE_CACHEABLE)
+			outer_flush_range(dst, dst + count);
+
+		src += count;
+		dst += count;
+		len -= count;
+	}
+	wmb();
+
+	nvmap_free_pte(dev, dst_pte);
+	nvmap_free_pte(dev, src_pte);
+	return 0;
+}
+
+/* relocate callback for nvmap_heap_compact; called with the heap locked */
+static int nvmap_carveout_relocate(struct nvmap_heap_block *block,
+				   unsigned long new_base)
+{
+	struct nvmap_handle *h = block->handle;
+	struct nvmap_device *dev = h->dev;
+	int err = -EBUSY;
+
+	if (!down_write_trylock(&h->carveout_sem))
+		return -EBUSY;
+
+	/* pinned handles are in use by hardware, and kernel mappings can't
+	 * be fixed up. the CPU may not be able to read secure memory. */
+	if (!h->alloc || h->secure || atomic_read(&h->pin) ||
+	    atomic_read(&h->kmaps))
+		goto out;
+
+	if (dev->dev_inode)
+		nvmap_zap_umaps(dev, h);
+
+	err = nvmap_carveout_copy(dev, h, new_base, block->base, h->size);
+	if (!err)
+		block->base = new_base;
+out:
+	up_write(&h->carveout_sem);
+	return err;
+}
+
+/* compacts the carveouts in usage until one of them can satisfy an
+ * allocation of len bytes; returns true if the allocation should be
+ * retried */
+static bool nvmap_carveout_compact(struct nvmap_device *dev, size_t len,
+				   size_t align, unsigned long usage)
+{
+	int i;
+
+	for (i = 0; i < dev->nr_carveouts; i++) {
+		struct nvmap_carveout_node *co_heap = &dev->heaps[i];
+
+		if (!(co_heap->heap_bit & usage))
+			continue;
+
+		if (nvmap_heap_compact(co_heap->carveout, len, align,
+				       nvmap_carveout_relocate))
+			return true;
+	}
+	return false;
+}
+
+static void nvmap_carveout_compact_work(struct work_struct *work)
+{
+	struct nvmap_device *dev = container_of(to_delayed_work(work),
+						struct nvmap_device,
+						compact_work);
+	int i;
+
+	for (i = 0; i < dev->nr_carveouts; i++)
+		nvmap_heap_compact(dev->heaps[i].carveout, 0, 0,
+				   nvmap_carveout_relocate);
+}
+
+/* called when a carveout block is freed, to compact the heaps once the
+ * frees have settled */
+void nvmap_carveout_compact_schedule(struct nvmap_device *dev)
+{
+	if (carveout_compact_delay)
+		schedule_delayed_work(&dev->compact_work,
+				msecs_to_jiffies(carveout_compact_delay));
+}
+#else
+#define nvmap_share_mapping(_dev, _inode, _filp)	do { } while (0)
+#define nvmap_carveout_compact(_dev, _len, _align, _usage)	false
+#endif
+
 struct nvmap_heap_block *do_nvmap_carveout_alloc(struct nvmap_client *client,
+						 struct nvmap_handle *handle,
 						 size_t len, size_t align,
 						 unsigned long usage,
 						 unsigned int prot)
@@ -417,7 +625,8 @@ struct nvmap_heap_block *do_nvmap_carveout_alloc(struct nvmap_client *client,
 		if (!(co_heap->heap_bit & usage))
 			continue;
 
-		block = nvmap_heap_alloc(co_heap->carveout, len, align, prot);
+		block = nvmap_heap_alloc(co_heap->carveout, len, align, prot,
+					 handle);
 		if (block) {
 			/* flush any stale data that may be left in the
 			 * cache at the block's address, since the new
@@ -439,6 +648,7 @@ static bool nvmap_carveout_freed(int count)
 }
 
 struct nvmap_heap_block *nvmap_carveout_alloc(struct nvmap_client *client,
+					      struct nvmap_handle *handle,
 					      size_t len, size_t align,
 					      unsigned long usage,
 					      unsigned int prot)
@@ -452,8 +662,13 @@ struct nvmap_heap_block *nvmap_carveout_alloc(struct nvmap_client *client,
 	int count = 0;
 
 	do {
-		block = do_nvmap_carveout_alloc(client, len, align,
+		block = do_nvmap_carveout_alloc(client, handle, len, align,
 						usage, prot);
+		/* moving unpinned allocations is cheaper than killing
+		 * their owners */
+		if (!block && nvmap_carveout_compact(dev, len, align, usage))
+			block = do_nvmap_carveout_alloc(client, handle, len,
+							align, usage, prot);
 		if (!carveout_killer)
 			return block;
 
@@ -503,8 +718,15 @@ struct nvmap_heap_block *nvmap_carveout_alloc(struct nvmap_client *client,
 	return NULL;
 }
 
-/* remove a handle from the device's tree of all handles; called
- * when freeing handles. */
+static inline struct hlist_head *nvmap_handle_hash(struct nvmap_device *dev,
+						   unsigned long id)
+{
+	return &dev->handles[hash_long(id, NVMAP_HANDLE_HASH_BITS)];
+}
+
+/* remove a handle from the device's hash of all handles; called
+ * when freeing handles. the caller must free the handle through RCU, since
+ * nvmap_validate_get may still be looking at it */
 int nvmap_handle_remove(struct nvmap_device *dev, struct nvmap_handle *h)
 {
 	spin_lock(&dev->handle_lock);
@@ -519,64 +741,44 @@ int nvmap_handle_remove(struct nvmap_device *dev, struct nvmap_handle *h)
 	BUG_ON(atomic_read(&h->ref) < 0);
 	BUG_ON(atomic_read(&h->pin) != 0);
 
-	rb_erase(&h->node, &dev->handles);
+	hlist_del_rcu(&h->node);
 
 	spin_unlock(&dev->handle_lock);
 	return 0;
 }
 
-/* adds a newly-created handle to the device master tree */
+/* adds a newly-created handle to the device master hash */
 void nvmap_handle_add(struct nvmap_device *dev, struct nvmap_handle *h)
 {
-	struct rb_node **p;
-	struct rb_node *parent = NULL;
-
 	spin_lock(&dev->handle_lock);
-	p = &dev->handles.rb_node;
-	while (*p) {
-		struct nvmap_handle *b;
-
-		parent = *p;
-		b = rb_entry(parent, struct nvmap_handle, node);
-		if (h > b)
-			p = &parent->rb_right;
-		else
-			p = &parent->rb_left;
-	}
-	rb_link_node(&h->node, parent, p);
-	rb_insert_color(&h->node, &dev->handles);
+	hlist_add_head_rcu(&h->node, nvmap_handle_hash(dev, (unsigned long)h));
 	spin_unlock(&dev->handle_lock);
 }
 
-/* validates that a handle is in the device master tree, and that the
- * client has permission to access it */
+/* validates that a handle is in the device master hash, and that the
+ * client has permission to access it. the lookup doesn't take any lock,
+ * so that clients pinning many handles at once don't serialize on the
+ * device; a handle whose last reference is being dropped is treated as
+ * already freed */
 struct nvmap_handle *nvmap_validate_get(struct nvmap_client *client,
 					unsigned long id)
 {
-	struct nvmap_handle *h = NULL;
-	struct rb_node *n;
-
-	spin_lock(&client->dev->handle_lock);
-
-	n = client->dev->handles.rb_node;
+	struct nvmap_handle *ret = NULL;
+	struct nvmap_handle *h;
+	struct hlist_node *pos;
 
-	while (n) {
-		h = rb_entry(n, struct nvmap_handle, node);
-		if ((unsigned long)h == id) {
-			if (client->super || h->global || (h->owner == client))
-				h = nvmap_handle_get(h);
-			else
-				h = NULL;
-			spin_unlock(&client->dev->handle_lock);
-			return h;
-		}
-		if (id > (unsigned long)h)
-			n = n->rb_right;
-		else
-			n = n->rb_left;
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(h, pos, nvmap_handle_hash(client->dev, id),
+				 node) {
+		if ((unsigned long)h != id)
+			continue;
+		if ((client->super || h->global || (h->owner == client)) &&
+		    atomic_inc_not_zero(&h->ref))
+			ret = h;
+		break;
 	}
-	spin_unlock(&client->dev->handle_lock);
-	return NULL;
+	rcu_read_unlock();
+	return ret;
 }
 
 struct nvmap_client *nvmap_create_client(struct nvmap_device *dev,
@@ -625,6 +827,11 @@ struct nvmap_client *nvmap_create_client(struct nvmap_device *dev,
 
 	spin_lock_init(&client->ref_lock);
 	atomic_set(&client->count, 1);
+	atomic_set(&client->sysmem_commit, 0);
+
+	spin_lock(&dev->clients_lock);
+	list_add(&client->list, &dev->clients);
+	spin_unlock(&dev->clients_lock);
 
 	return client;
 }
@@ -637,6 +844,9 @@ static void destroy_client(struct nvmap_client *client)
 	if (!client)
 		return;
 
+	spin_lock(&client->dev->clients_lock);
+	list_del(&client->list);
+	spin_unlock(&client->dev->clients_lock);
 
 	while ((n = rb_first(&client->handle_refs))) {
 		struct nvmap_handle_ref *ref;
@@ -732,6 +942,7 @@ static int nvmap_open(struct inode *inode, struct file *filp)
 
 	priv->super = (filp->f_op == &nvmap_super_fops);
 
+	nvmap_share_mapping(dev, inode, filp);
 	filp->f_mapping->backing_dev_info = &nvmap_bdi;
 
 	filp->private_data = priv;
@@ -760,6 +971,13 @@ static int nvmap_map(struct file *filp, struct vm_area_struct *vma)
 	priv->offs = 0;
 	priv->handle = NULL;
 	atomic_set(&priv->count, 1);
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	/* the window also covers the offset passed to mmap, which
+	 * nvmap_vma_fault adds to the handle offset */
+	priv->pages = vma->vm_pgoff + vma_pages(vma);
+	priv->pgoff = nvmap_alloc_pgoff(priv->pages);
+	vma->vm_pgoff += priv->pgoff;
+#endif
 
 	vma->vm_flags |= VM_SHARED;
 	vma->vm_flags |= (VM_IO | VM_DONTEXPAND | VM_MIXEDMAP | VM_RESERVED);
@@ -833,6 +1051,10 @@ static long nvmap_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		err = nvmap_ioctl_cache_maint(filp, uarg);
 		break;
 
+	case NVMAP_IOC_CACHE_LIST:
+		err = nvmap_ioctl_cache_maint_list(filp, uarg);
+		break;
+
 	default:
 		return -ENOTTY;
 	}
@@ -860,8 +1082,10 @@ static void nvmap_vma_close(struct vm_area_struct *vma)
 	struct nvmap_vma_priv *priv = vma->vm_private_data;
 
 	if (priv && !atomic_dec_return(&priv->count)) {
-		if (priv->handle)
+		if (priv->handle) {
+			nvmap_umap_del(priv->handle, priv);
 			nvmap_handle_put(priv->handle);
+		}
 		kfree(priv);
 	}
 
@@ -881,16 +1105,25 @@ static int nvmap_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	offs += priv->offs;
 	/* if the VMA was split for some reason, vm_pgoff will be the VMA's
 	 * offset from the original VMA */
-	offs += (vma->vm_pgoff << PAGE_SHIFT);
+	offs += ((vma->vm_pgoff - priv->pgoff) << PAGE_SHIFT);
 
 	if (offs >= priv->handle->size)
 		return VM_FAULT_SIGBUS;
 
+	nvmap_handle_mark_dirty(priv->handle);
+
 	if (!priv->handle->heap_pgalloc) {
 		unsigned long pfn;
+		/* the compactor is moving the handle; the access will fault
+		 * again once it has finished */
+		if (!nvmap_carveout_trylock(priv->handle)) {
+			set_need_resched();
+			return VM_FAULT_NOPAGE;
+		}
 		BUG_ON(priv->handle->carveout->base & ~PAGE_MASK);
 		pfn = ((priv->handle->carveout->base + offs) >> PAGE_SHIFT);
 		vm_insert_pfn(vma, (unsigned long)vmf->virtual_address, pfn);
+		nvmap_carveout_unlock(priv->handle);
 		return VM_FAULT_NOPAGE;
 	} else {
 		struct page *page;
@@ -1015,6 +1248,91 @@ static struct file_operations debug_clients_fops = {
 	.release = single_release,
 };
 
+static void client_stats(struct nvmap_client *client,
+			 struct nvmap_client_stats *stats)
+{
+	size_t carveout = 0;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (client->task) {
+		stats->pid = client->task->pid;
+		get_task_comm(stats->comm, client->task);
+	} else {
+		strlcpy(stats->comm, client->name, sizeof(stats->comm));
+	}
+
+	for (i = 0; i < client->dev->nr_carveouts; i++)
+		carveout += client->carveout_commit[i].commit;
+
+	stats->carveout = carveout;
+	stats->iovmm = atomic_read(&client->iovm_commit);
+	stats->sysmem = atomic_read(&client->sysmem_commit);
+}
+
+struct client_stats_snapshot {
+	size_t len;
+	struct nvmap_client_stats stats[0];
+};
+
+/* client_stats is read as an array of struct nvmap_client_stats, one for
+ * each client that existed when the file was opened */
+static int nvmap_debug_client_stats_open(struct inode *inode,
+					 struct file *file)
+{
+	struct nvmap_device *dev = inode->i_private;
+	struct client_stats_snapshot *snap;
+	struct nvmap_client *client;
+	unsigned int count = 0;
+	unsigned int i = 0;
+
+	spin_lock(&dev->clients_lock);
+	list_for_each_entry(client, &dev->clients, list)
+		count++;
+	spin_unlock(&dev->clients_lock);
+
+	snap = kmalloc(sizeof(*snap) + count * sizeof(snap->stats[0]),
+		       GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+
+	/* clients created after the count are left out of the snapshot */
+	spin_lock(&dev->clients_lock);
+	list_for_each_entry(client, &dev->clients, list) {
+		if (i == count)
+			break;
+		client_stats(client, &snap->stats[i++]);
+	}
+	spin_unlock(&dev->clients_lock);
+
+	snap->len = i * sizeof(snap->stats[0]);
+	file->private_data = snap;
+	return 0;
+}
+
+static ssize_t nvmap_debug_client_stats_read(struct file *file,
+					     char __user *buf, size_t len,
+					     loff_t *ppos)
+{
+	struct client_stats_snapshot *snap = file->private_data;
+
+	return simple_read_from_buffer(buf, len, ppos, snap->stats, snap->len);
+}
+
+static int nvmap_debug_client_stats_release(struct inode *inode,
+					    struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static struct file_operations debug_client_stats_fops = {
+	.open = nvmap_debug_client_stats_open,
+	.read = nvmap_debug_client_stats_read,
+	.llseek = default_llseek,
+	.release = nvmap_debug_client_stats_release,
+};
+
 static int nvmap_probe(struct platform_device *pdev)
 {
 	struct nvmap_platform_data *plat = pdev->dev.platform_data;
@@ -1049,9 +1367,13 @@ static int nvmap_probe(struct platform_device *pdev)
 	dev->dev_super.fops = &nvmap_super_fops;
 	dev->dev_super.parent = &pdev->dev;
 
-	dev->handles = RB_ROOT;
+	for (i = 0; i < ARRAY_SIZE(dev->handles); i++)
+		INIT_HLIST_HEAD(&dev->handles[i]);
 
 	init_waitqueue_head(&dev->pte_wait);
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	INIT_DELAYED_WORK(&dev->compact_work, nvmap_carveout_compact_work);
+#endif
 
 	init_waitqueue_head(&dev->iovmm_master.pin_wait);
 	mutex_init(&dev->iovmm_master.pin_lock);
@@ -1073,9 +1395,16 @@ static int nvmap_probe(struct platform_device *pdev)
 		dev_err(&pdev->dev, "couldn't initialize MRU lists\n");
 		goto fail;
 	}
+	e = nvmap_page_pool_init(&dev->iovmm_master);
+	if (e) {
+		dev_err(&pdev->dev, "couldn't initialize page pools\n");
+		goto fail;
+	}
 
 	spin_lock_init(&dev->ptelock);
 	spin_lock_init(&dev->handle_lock);
+	spin_lock_init(&dev->clients_lock);
+	INIT_LIST_HEAD(&dev->clients);
 
 	for (i = 0; i < NVMAP_NUM_PTES; i++) {
 		unsigned long addr;
@@ -1131,6 +1460,9 @@ static int nvmap_probe(struct platform_device *pdev)
 	nvmap_debug_root = debugfs_create_dir("nvmap", NULL);
 	if (IS_ERR_OR_NULL(nvmap_debug_root))
 		dev_err(&pdev->dev, "couldn't create debug files\n");
+	else
+		debugfs_create_file("client_stats", 0444, nvmap_debug_root,
+				    dev, &debug_client_stats_fops);
 
 	for (i = 0; i < plat->nr_carveouts; i++) {
 		struct nvmap_carveout_node *node = &dev->heaps[i];
@@ -1178,6 +1510,7 @@ fail_heaps:
 	}
 fail:
 	kfree(dev->heaps);
+	nvmap_page_pool_destroy(&dev->iovmm_master);
 	nvmap_mru_destroy(&dev->iovmm_master);
 	if (dev->dev_super.minor != MISC_DYNAMIC_MINOR)
 		misc_deregister(&dev->dev_super);
@@ -1195,23 +1528,31 @@ fail:
 static int nvmap_remove(struct platform_device *pdev)
 {
 	struct nvmap_device *dev = platform_get_drvdata(pdev);
-	struct rb_node *n;
+	struct hlist_node *pos, *n;
 	struct nvmap_handle *h;
 	int i;
 
 	misc_deregister(&dev->dev_super);
 	misc_deregister(&dev->dev_user);
 
-	while ((n = rb_first(&dev->handles))) {
-		h = rb_entry(n, struct nvmap_handle, node);
-		rb_erase(&h->node, &dev->handles);
-		kfree(h);
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	cancel_delayed_work_sync(&dev->compact_work);
+	if (dev->dev_inode)
+		iput(dev->dev_inode);
+#endif
+
+	for (i = 0; i < ARRAY_SIZE(dev->handles); i++) {
+		hlist_for_each_entry_safe(h, pos, n, &dev->handles[i], node) {
+			hlist_del(&h->node);
+			kfree(h);
+		}
 	}
 
 	if (!IS_ERR_OR_NULL(dev->iovmm_master.iovmm))
 		tegra_iovmm_free_client(dev->iovmm_master.iovmm);
 
 	nvmap_mru_destroy(&dev->iovmm_master);
+	nvmap_page_pool_destroy(&dev->iovmm_master);
 
 	for (i = 0; i < dev->nr_carveouts; i++) {
 		struct nvmap_carveout_node *node = &dev->heaps[i];
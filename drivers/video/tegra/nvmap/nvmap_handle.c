@@ -37,13 +37,10 @@
 
 #include "nvmap.h"
 #include "nvmap_mru.h"
+#include "nvmap_pool.h"
+#include "nvmap_trace.h"
 
 #define NVMAP_SECURE_HEAPS	(NVMAP_HEAP_CARVEOUT_IRAM | NVMAP_HEAP_IOVMM)
-#ifdef CONFIG_NVMAP_HIGHMEM_ONLY
-#define GFP_NVMAP		(__GFP_HIGHMEM | __GFP_NOWARN)
-#else
-#define GFP_NVMAP		(GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
-#endif
 /* handles may be arbitrarily large (16+MiB), and any handle allocated from
  * the kernel (i.e., not a carveout handle) includes its array of pages. to
  * preserve kmalloc space, if the array of pages exceeds PAGELIST_VMALLOC_MIN,
@@ -69,10 +66,27 @@ static inline void altfree(void *ptr, size_t len)
 		kfree(ptr);
 }
 
+/* returns pages to the handle's page pool, and any the pool doesn't
+ * want to the page allocator */
+static void handle_free_pages(struct nvmap_share *share, unsigned long flags,
+			      struct page **pages, unsigned int nr_page)
+{
+	unsigned int i;
+
+	i = nvmap_page_pool_release(share, flags, pages, nr_page);
+	for (; i < nr_page; i++)
+		__free_page(pages[i]);
+}
+
+static void handle_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct nvmap_handle, rcu));
+}
+
 void _nvmap_handle_free(struct nvmap_handle *h)
 {
 	struct nvmap_device *dev = h->dev;
-	unsigned int i, nr_page;
+	unsigned int nr_page;
 
 	if (nvmap_handle_remove(dev, h) != 0)
 		return;
@@ -82,6 +96,7 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 
 	if (!h->heap_pgalloc) {
 		nvmap_heap_free(h->carveout);
+		nvmap_carveout_compact_schedule(dev);
 		goto out;
 	}
 
@@ -95,17 +110,15 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 	if (h->pgalloc.area)
 		tegra_iovmm_free_vm(h->pgalloc.area);
 
-	for (i = 0; i < nr_page; i++)
-		__free_page(h->pgalloc.pages[i]);
+	handle_free_pages(nvmap_get_share_from_dev(dev), h->flags,
+			  h->pgalloc.pages, nr_page);
 
 	altfree(h->pgalloc.pages, nr_page * sizeof(struct page *));
 
 out:
-	kfree(h);
+	call_rcu(&h->rcu, handle_free_rcu);
 }
 
-extern void __flush_dcache_page(struct address_space *, struct page *);
-
 static struct page *nvmap_alloc_pages_exact(gfp_t gfp, size_t size)
 {
 	struct page *page, *p, *e;
@@ -155,7 +168,7 @@ static int handle_page_alloc(struct nvmap_client *client,
 #endif
 
 	h->pgalloc.area = NULL;
-	if (contiguous) {
+	if (contiguous && nr_page > 1) {
 		struct page *page;
 		page = nvmap_alloc_pages_exact(GFP_NVMAP, size);
 		if (!page)
@@ -165,21 +178,27 @@ static int handle_page_alloc(struct nvmap_client *client,
 			pages[i] = nth_page(page, i);
 
 	} else {
-		for (i = 0; i < nr_page; i++) {
+		/* pool pages are already clean; only pages that come
+		 * straight from the page allocator need cache maintenance */
+		i = nvmap_page_pool_alloc(client->share, h->flags,
+					  pages, nr_page);
+		for (; i < nr_page; i++) {
 			pages[i] = nvmap_alloc_pages_exact(GFP_NVMAP, PAGE_SIZE);
 			if (!pages[i])
 				goto fail;
 		}
+	}
 
 #ifndef CONFIG_NVMAP_RECLAIM_UNPINNED_VM
+	if (!contiguous) {
 		h->pgalloc.area = tegra_iovmm_create_vm(client->share->iovmm,
 							NULL, size, prot);
 		if (!h->pgalloc.area)
 			goto fail;
 
 		h->pgalloc.dirty = true;
-#endif
 	}
+#endif
 
 
 	h->size = size;
@@ -189,8 +208,7 @@ static int handle_page_alloc(struct nvmap_client *client,
 	return 0;
 
 fail:
-	while (i--)
-		__free_page(pages[i]);
+	handle_free_pages(client->share, h->flags, pages, i);
 	altfree(pages, nr_page * sizeof(*pages));
 	return -ENOMEM;
 }
@@ -202,7 +220,7 @@ static void alloc_handle(struct nvmap_client *client, size_t align,
 
 	if (type & NVMAP_HEAP_CARVEOUT_MASK) {
 		struct nvmap_heap_block *b;
-		b = nvmap_carveout_alloc(client, h->size, align,
+		b = nvmap_carveout_alloc(client, h, h->size, align,
 					 type, h->flags);
 		if (b) {
 			h->carveout = b;
@@ -242,6 +260,7 @@ static void alloc_handle(struct nvmap_client *client, size_t align,
 			BUG_ON(!h->pgalloc.contig);
 			h->heap_pgalloc = true;
 			h->alloc = true;
+			atomic_add(h->size, &client->sysmem_commit);
 		}
 	}
 }
@@ -330,6 +349,9 @@ int nvmap_alloc_handle_id(struct nvmap_client *client,
 		}
 	}
 
+	if (h->alloc)
+		trace_nvmap_alloc_handle(client, h);
+
 out:
 	err = (h->alloc) ? 0 : err;
 	nvmap_handle_put(h);
@@ -361,10 +383,14 @@ void nvmap_free_handle_id(struct nvmap_client *client, unsigned long id)
 	smp_rmb();
 	pins = atomic_read(&ref->pin);
 	rb_erase(&ref->node, &client->handle_refs);
+	trace_nvmap_free_handle(client, h);
 
 	if (h->alloc && h->heap_pgalloc && !h->pgalloc.contig)
 		atomic_sub(h->size, &client->iovm_commit);
 
+	if (h->alloc && h->heap_pgalloc && h->pgalloc.contig)
+		atomic_sub(h->size, &client->sysmem_commit);
+
 	if (h->alloc && !h->heap_pgalloc)
 		nvmap_carveout_commit_subtract(client,
 		nvmap_heap_to_arg(nvmap_block_to_heap(h->carveout)),
@@ -436,7 +462,13 @@ struct nvmap_handle_ref *nvmap_create_handle(struct nvmap_client *client,
 	BUG_ON(!h->owner);
 	h->size = h->orig_size = size;
 	h->flags = NVMAP_HANDLE_WRITE_COMBINE;
+	atomic_set(&h->kmaps, 0);
 	mutex_init(&h->lock);
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+	init_rwsem(&h->carveout_sem);
+	mutex_init(&h->umap_lock);
+	INIT_LIST_HEAD(&h->umap_list);
+#endif
 
 	nvmap_handle_add(client->dev, h);
 
@@ -444,6 +476,7 @@ struct nvmap_handle_ref *nvmap_create_handle(struct nvmap_client *client,
 	ref->handle = h;
 	atomic_set(&ref->pin, 0);
 	add_handle_ref(client, ref);
+	trace_nvmap_create_handle(client, h);
 	return ref;
 }
 
@@ -509,6 +542,8 @@ struct nvmap_handle_ref *nvmap_duplicate_handle_id(struct nvmap_client *client,
 		nvmap_carveout_commit_add(client,
 			nvmap_heap_to_arg(nvmap_block_to_heap(h->carveout)),
 			h->size);
+	else if (h->pgalloc.contig)
+		atomic_add(h->size, &client->sysmem_commit);
 
 	atomic_set(&ref->dupes, 1);
 	ref->handle = h;
@@ -99,6 +99,7 @@ struct list_block {
 	unsigned int mem_prot;
 	unsigned long orig_addr;
 	size_t size;
+	size_t align;
 	struct nvmap_heap *heap;
 	struct list_head free_list;
 };
@@ -371,13 +372,69 @@ static struct buddy_heap *do_buddy_free(struct nvmap_heap_block *block)
 	return NULL;
 }
 
+/* allocates the range [fix_base, fix_base + len) from the free block b,
+ * returning any space left before and after it to the free list. must be
+ * called while holding the heap's lock. */
+static struct nvmap_heap_block *do_heap_carve(struct nvmap_heap *heap,
+					      struct list_block *b,
+					      unsigned long fix_base,
+					      size_t len, size_t align,
+					      unsigned int mem_prot)
+{
+	struct list_block *rem = NULL;
+
+	if (b->block.base != fix_base) {
+		rem = kmem_cache_zalloc(block_cache, GFP_KERNEL);
+		if (!rem) {
+			b->orig_addr = b->block.base;
+			b->block.base = fix_base;
+			b->size -= (b->block.base - b->orig_addr);
+			goto out;
+		}
+
+		rem->block.type = BLOCK_FIRST_FIT;
+		rem->block.base = b->block.base;
+		rem->orig_addr = rem->block.base;
+		rem->size = fix_base - rem->block.base;
+		b->block.base = fix_base;
+		b->orig_addr = fix_base;
+		b->size -= rem->size;
+		list_add_tail(&rem->all_list, &heap->all_list);
+		list_add_tail(&rem->free_list, &b->free_list);
+	}
+
+	b->orig_addr = b->block.base;
+
+	if (b->size > len) {
+		rem = kmem_cache_zalloc(block_cache, GFP_KERNEL);
+		if (!rem)
+			goto out;
+
+		rem->block.type = BLOCK_FIRST_FIT;
+		rem->block.base = b->block.base + len;
+		rem->size = b->size - len;
+		BUG_ON(rem->size > b->size);
+		rem->orig_addr = rem->block.base;
+		b->size = len;
+		list_add_tail(&rem->all_list, &heap->all_list);
+		list_add(&rem->free_list, &b->free_list);
+	}
+
+out:
+	list_del(&b->free_list);
+	b->heap = heap;
+	b->mem_prot = mem_prot;
+	b->align = align;
+	b->block.handle = NULL;
+	return &b->block;
+}
+
 static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 					      size_t len, size_t align,
 					      unsigned int mem_prot)
 {
 	struct list_block *b = NULL;
 	struct list_block *i = NULL;
-	struct list_block *rem = NULL;
 	unsigned long fix_base;
 	enum direction dir;
 
@@ -421,48 +478,7 @@ static struct nvmap_heap_block *do_heap_alloc(struct nvmap_heap *heap,
 	if (!b)
 		return NULL;
 
-	if (b->block.base != fix_base) {
-		rem = kmem_cache_zalloc(block_cache, GFP_KERNEL);
-		if (!rem) {
-			b->orig_addr = b->block.base;
-			b->block.base = fix_base;
-			b->size -= (b->block.base - b->orig_addr);
-			goto out;
-		}
-
-		rem->block.type = BLOCK_FIRST_FIT;
-		rem->block.base = b->block.base;
-		rem->orig_addr = rem->block.base;
-		rem->size = fix_base - rem->block.base;
-		b->block.base = fix_base;
-		b->orig_addr = fix_base;
-		b->size -= rem->size;
-		list_add_tail(&rem->all_list, &heap->all_list);
-		list_add_tail(&rem->free_list, &b->free_list);
-	}
-
-	b->orig_addr = b->block.base;
-
-	if (b->size > len) {
-		rem = kmem_cache_zalloc(block_cache, GFP_KERNEL);
-		if (!rem)
-			goto out;
-
-		rem->block.type = BLOCK_FIRST_FIT;
-		rem->block.base = b->block.base + len;
-		rem->size = b->size - len;
-		BUG_ON(rem->size > b->size);
-		rem->orig_addr = rem->block.base;
-		b->size = len;
-		list_add_tail(&rem->all_list, &heap->all_list);
-		list_add(&rem->free_list, &b->free_list);
-	}
-
-out:
-	list_del(&b->free_list);
-	b->heap = heap;
-	b->mem_prot = mem_prot;
-	return &b->block;
+	return do_heap_carve(heap, b, fix_base, len, align, mem_prot);
 }
 
 #ifdef DEBUG_FREE_LIST
@@ -494,6 +510,7 @@ static void do_heap_free(struct nvmap_heap_block *block)
 	BUG_ON(b->block.base > b->orig_addr);
 	b->size += (b->block.base - b->orig_addr);
 	b->block.base = b->orig_addr;
+	b->block.handle = NULL;
 
 	freelist_debug(heap, "free list before", b);
 
@@ -568,7 +585,8 @@ static struct nvmap_heap_block *do_buddy_alloc(struct nvmap_heap *h,
 /* nvmap_heap_alloc: allocates a block of memory of len bytes, aligned to
  * align bytes. */
 struct nvmap_heap_block *nvmap_heap_alloc(struct nvmap_heap *h, size_t len,
-					  size_t align, unsigned int prot)
+					  size_t align, unsigned int prot,
+					  struct nvmap_handle *handle)
 {
 	struct nvmap_heap_block *b;
 
@@ -581,6 +599,8 @@ struct nvmap_heap_block *nvmap_heap_alloc(struct nvmap_heap *h, size_t len,
 		align = max(align, (size_t)L1_CACHE_BYTES);
 		b = do_heap_alloc(h, len, align, prot);
 	}
+	if (b)
+		b->handle = handle;
 	mutex_unlock(&h->lock);
 	return b;
 }
@@ -616,6 +636,199 @@ void nvmap_heap_free(struct nvmap_heap_block *b)
 		mutex_unlock(&h->lock);
 }
 
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+/*
+ * compaction moves allocated first-fit blocks towards the end of the heap
+ * that their allocation strategy fills from: blocks which would have been
+ * allocated BOTTOM_UP are moved into the lowest free block below them that
+ * fits, TOP_DOWN blocks into the highest free block above them. the space
+ * they leave behind merges with its free neighbours. only blocks which
+ * belong to a handle are considered; buddy sub-heaps stay where they are.
+ *
+ * the block keeps its list_block (and therefore the handle's pointer to it)
+ * across the move: the relocate callback updates block.base, and the heap
+ * then gives the old range to the block that was carved for the new one
+ * and frees it.
+ */
+
+/* returns true if a first-fit allocation of len bytes aligned to align
+ * would succeed. must be called while holding the heap's lock. */
+static bool heap_fits(struct nvmap_heap *heap, size_t len, size_t align)
+{
+	struct list_block *i;
+
+	list_for_each_entry(i, &heap->free_list, free_list) {
+		unsigned long fix_base = ALIGN(i->block.base, align);
+
+		if (fix_base + len <= i->block.base + i->size)
+			return true;
+	}
+	return false;
+}
+
+/* finds the free block that b should move into, and the new base address
+ * inside it. must be called while holding the heap's lock. */
+static struct list_block *find_hole(struct nvmap_heap *heap,
+				    struct list_block *b, enum direction dir,
+				    unsigned long *fix_base)
+{
+	struct list_block *i;
+
+	if (dir == BOTTOM_UP) {
+		list_for_each_entry(i, &heap->free_list, free_list) {
+			unsigned long base = ALIGN(i->block.base, b->align);
+
+			if (i->block.base > b->block.base)
+				break;
+			if (base + b->size <= i->block.base + i->size) {
+				*fix_base = base;
+				return i;
+			}
+		}
+	} else {
+		list_for_each_entry_reverse(i, &heap->free_list, free_list) {
+			unsigned long base;
+
+			if (i->block.base < b->block.base)
+				break;
+			if (i->size < b->size)
+				continue;
+			base = i->block.base + i->size - b->size;
+			base &= ~(b->align - 1);
+			if (base >= i->block.base) {
+				*fix_base = base;
+				return i;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* returns the movable block following (BOTTOM_UP) or preceding (TOP_DOWN)
+ * address pos which would be allocated in direction dir. the all_list is
+ * not kept in address order, so this is a linear scan. */
+static struct list_block *next_movable(struct nvmap_heap *heap,
+				       unsigned long pos, enum direction dir)
+{
+	struct list_block *next = NULL;
+	struct list_block *i;
+
+	list_for_each_entry(i, &heap->all_list, all_list) {
+		bool up = (i->size <= heap->small_alloc);
+
+		if (!i->block.handle || up != (dir == BOTTOM_UP))
+			continue;
+
+		if (dir == BOTTOM_UP) {
+			if (i->block.base < pos)
+				continue;
+			if (!next || i->block.base < next->block.base)
+				next = i;
+		} else {
+			if (i->block.base > pos)
+				continue;
+			if (!next || i->block.base > next->block.base)
+				next = i;
+		}
+	}
+	return next;
+}
+
+/* moves b into the hole at fix_base. must be called while holding the
+ * heap's lock. */
+static bool heap_move_block(struct nvmap_heap *heap, struct list_block *b,
+			    struct list_block *hole, unsigned long fix_base,
+			    nvmap_heap_relocate_fn relocate)
+{
+	unsigned long old_base = b->block.base;
+	struct nvmap_heap_block *block;
+	struct list_block *n;
+
+	block = do_heap_carve(heap, hole, fix_base, b->size, b->align,
+			      b->mem_prot);
+	n = container_of(block, struct list_block, block);
+
+	if (relocate(&b->block, n->block.base) ||
+	    WARN_ON(b->block.base != n->block.base)) {
+		do_heap_free(&n->block);
+		return false;
+	}
+
+	swap(b->orig_addr, n->orig_addr);
+	swap(b->size, n->size);
+	n->block.base = old_base;
+	do_heap_free(&n->block);
+	return true;
+}
+
+static bool heap_compact_dir(struct nvmap_heap *heap, size_t len, size_t align,
+			     enum direction dir, nvmap_heap_relocate_fn relocate)
+{
+	unsigned long pos = (dir == BOTTOM_UP) ? 0 : -1ul;
+	bool moved = false;
+	struct list_block *b;
+
+	while ((b = next_movable(heap, pos, dir))) {
+		struct list_block *hole;
+		unsigned long fix_base;
+
+		if (dir == BOTTOM_UP)
+			pos = b->block.base + 1;
+		else if (!b->block.base)
+			break;
+		else
+			pos = b->block.base - 1;
+
+		hole = find_hole(heap, b, dir, &fix_base);
+		if (!hole || !heap_move_block(heap, b, hole, fix_base, relocate))
+			continue;
+
+		moved = true;
+		if (len && heap_fits(heap, len, align))
+			break;
+	}
+	return moved;
+}
+
+/* nvmap_heap_compact: moves blocks until an allocation of len bytes aligned
+ * to align would succeed, or compacts the whole heap if len is 0. returns
+ * true if the allocation should be retried (or, for a len of 0, if any block
+ * was moved). */
+bool nvmap_heap_compact(struct nvmap_heap *heap, size_t len, size_t align,
+			nvmap_heap_relocate_fn relocate)
+{
+	bool ret;
+
+	/* match the size and alignment nvmap_heap_alloc will ask for */
+	if (len && len <= heap->buddy_heap_size / 2) {
+		len = heap->buddy_heap_size;
+		align = heap->buddy_heap_size;
+	} else if (len) {
+		if (heap->buddy_heap_size)
+			len = ALIGN(len, heap->buddy_heap_size);
+		align = max(align, (size_t)L1_CACHE_BYTES);
+	}
+
+	mutex_lock(&heap->lock);
+	if (len) {
+		if (!heap_fits(heap, len, align))
+			heap_compact_dir(heap, len, align, BOTTOM_UP, relocate);
+		if (!heap_fits(heap, len, align))
+			heap_compact_dir(heap, len, align, TOP_DOWN, relocate);
+		ret = heap_fits(heap, len, align);
+	} else if (list_is_singular(&heap->free_list)) {
+		/* the free space is already in one piece */
+		ret = false;
+	} else {
+		ret = heap_compact_dir(heap, 0, 0, BOTTOM_UP, relocate);
+		ret |= heap_compact_dir(heap, 0, 0, TOP_DOWN, relocate);
+	}
+	mutex_unlock(&heap->lock);
+
+	return ret;
+}
+#endif
+
 struct nvmap_heap *nvmap_block_to_heap(struct nvmap_heap_block *b)
 {
 	if (b->type == BLOCK_BUDDY) {
@@ -24,12 +24,14 @@
 #define __NVMAP_HEAP_H
 
 struct device;
+struct nvmap_handle;
 struct nvmap_heap;
 struct attribute_group;
 
 struct nvmap_heap_block {
 	unsigned long	base;
 	unsigned int	type;
+	struct nvmap_handle *handle;	/* handle that owns the block */
 };
 
 #define NVMAP_HEAP_MIN_BUDDY_SIZE	8192
@@ -45,12 +47,23 @@ void *nvmap_heap_device_to_arg(struct device *dev);
 void *nvmap_heap_to_arg(struct nvmap_heap *heap);
 
 struct nvmap_heap_block *nvmap_heap_alloc(struct nvmap_heap *heap, size_t len,
-					  size_t align, unsigned int prot);
+					  size_t align, unsigned int prot,
+					  struct nvmap_handle *handle);
 
 struct nvmap_heap *nvmap_block_to_heap(struct nvmap_heap_block *b);
 
 void nvmap_heap_free(struct nvmap_heap_block *block);
 
+#ifdef CONFIG_NVMAP_CARVEOUT_COMPACTOR
+/* copies the contents of block to new_base and sets block->base to it;
+ * returns non-zero if the block can't be moved right now */
+typedef int (*nvmap_heap_relocate_fn)(struct nvmap_heap_block *block,
+				      unsigned long new_base);
+
+bool nvmap_heap_compact(struct nvmap_heap *heap, size_t len, size_t align,
+			nvmap_heap_relocate_fn relocate);
+#endif
+
 int nvmap_heap_create_group(struct nvmap_heap *heap,
 			    const struct attribute_group *grp);
 
@@ -23,6 +23,7 @@
 #include <linux/dma-mapping.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/moduleparam.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 
@@ -35,6 +36,7 @@
 
 #include "nvmap_ioctl.h"
 #include "nvmap.h"
+#include "nvmap_trace.h"
 
 static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 			 int is_read, unsigned long h_offs,
@@ -45,6 +47,16 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 		       unsigned long start, unsigned long end, unsigned int op);
 
+/* maintenance by MVA costs a cache operation for every line in the range,
+ * while cleaning and invalidating a whole cache by set/way costs the same
+ * regardless of the range. ranges of at least the threshold size are
+ * maintained with whole-cache operations instead, which are valid for
+ * every op since they both clean and invalidate */
+static unsigned int cache_maint_inner_threshold = 16 * PAGE_SIZE;
+module_param(cache_maint_inner_threshold, uint, 0644);
+
+static unsigned int cache_maint_outer_threshold = 256 * PAGE_SIZE;
+module_param(cache_maint_outer_threshold, uint, 0644);
 
 int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg)
 {
@@ -276,10 +288,12 @@ int nvmap_map_into_caller_ptr(struct file *filp, void __user *arg)
 		goto out;
 	}
 
+	nvmap_umap_add(h, vpriv);
 	vpriv->handle = h;
 	vpriv->offs = op.offset;
 
 	vma->vm_page_prot = nvmap_pgprot(h, vma->vm_page_prot);
+	trace_nvmap_mmap(client, h);
 
 out:
 	up_read(&current->mm->mmap_sem);
@@ -302,6 +316,7 @@ int nvmap_ioctl_get_param(struct file *filp, void __user* arg)
 	if (!h)
 		return -EINVAL;
 
+	nvmap_carveout_lock(h);
 	switch (op.param) {
 	case NVMAP_HANDLE_PARAM_SIZE:
 		op.result = h->orig_size;
@@ -317,6 +332,8 @@ int nvmap_ioctl_get_param(struct file *filp, void __user* arg)
 			op.result = SZ_4M;
 		break;
 	case NVMAP_HANDLE_PARAM_BASE:
+		/* only stable while the handle stays pinned: the compactor
+		 * may move a carveout handle once it is unpinned */
 		if (WARN_ON(!h->alloc || !atomic_add_return(0, &h->pin)))
 			op.result = -1ul;
 		else if (!h->heap_pgalloc)
@@ -329,19 +346,13 @@ int nvmap_ioctl_get_param(struct file *filp, void __user* arg)
 			op.result = -1ul;
 		break;
 	case NVMAP_HANDLE_PARAM_HEAP:
-		if (!h->alloc)
-			op.result = 0;
-		else if (!h->heap_pgalloc)
-			op.result = nvmap_carveout_usage(client, h->carveout);
-		else if (h->pgalloc.contig)
-			op.result = NVMAP_HEAP_SYSMEM;
-		else
-			op.result = NVMAP_HEAP_IOVMM;
+		op.result = nvmap_handle_heap(h);
 		break;
 	default:
 		err = -EINVAL;
 		break;
 	}
+	nvmap_carveout_unlock(h);
 
 	if (!err && copy_to_user(arg, &op, sizeof(op)))
 		err = -EFAULT;
@@ -386,45 +397,248 @@ int nvmap_ioctl_rw_handle(struct file *filp, int is_read, void __user* arg)
 	return err;
 }
 
+/* looks up the handle that user space has mapped at op->addr. on success,
+ * op->addr is replaced by the offset into the handle that the operation
+ * starts at. called with mmap_sem held */
+static int cache_op_lookup(struct nvmap_cache_op *op)
+{
+	struct vm_area_struct *vma;
+	struct nvmap_vma_priv *vpriv;
+	struct nvmap_handle *h;
+
+	if (!op->handle || !op->addr || op->op < NVMAP_CACHE_OP_WB ||
+	    op->op > NVMAP_CACHE_OP_WB_INV)
+		return -EINVAL;
+
+	vma = find_vma(current->active_mm, op->addr);
+	if (!vma || !is_nvmap_vma(vma) || op->addr + op->len > vma->vm_end)
+		return -EADDRNOTAVAIL;
+
+	vpriv = (struct nvmap_vma_priv *)vma->vm_private_data;
+	h = vpriv->handle;
+
+	if ((unsigned long)h != op->handle)
+		return -EFAULT;
+
+	op->addr -= vma->vm_start;
+	if (op->addr + op->len > h->size)
+		return -EINVAL;
+
+	return 0;
+}
+
+static bool cache_op_maintains(struct nvmap_handle *h)
+{
+	return h->alloc && h->flags != NVMAP_HANDLE_UNCACHEABLE &&
+		h->flags != NVMAP_HANDLE_WRITE_COMBINE;
+}
+
+static bool cache_op_needed(struct nvmap_handle *h, unsigned int op)
+{
+	return cache_op_maintains(h) &&
+		(op != NVMAP_CACHE_OP_WB || h->cpu_dirty);
+}
+
+static int user_cache_maint(struct nvmap_client *client,
+			    struct nvmap_cache_op *op)
+{
+	struct nvmap_handle *h = (struct nvmap_handle *)op->handle;
+	int err;
+
+	if (h->alloc && !cache_op_needed(h, op->op))
+		return 0;
+
+	nvmap_carveout_lock(h);
+	err = cache_maint(client, h, op->addr, op->addr + op->len, op->op);
+	nvmap_carveout_unlock(h);
+
+	return err;
+}
+
 int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg)
 {
 	struct nvmap_client *client = filp->private_data;
 	struct nvmap_cache_op op;
-	struct vm_area_struct *vma;
-	struct nvmap_vma_priv *vpriv;
-	unsigned long start;
-	unsigned long end;
-	int err = 0;
+	int err;
 
 	if (copy_from_user(&op, arg, sizeof(op)))
 		return -EFAULT;
 
-	if (!op.handle || !op.addr || op.op < NVMAP_CACHE_OP_WB ||
-	    op.op > NVMAP_CACHE_OP_WB_INV)
+	down_read(&current->mm->mmap_sem);
+
+	err = cache_op_lookup(&op);
+	if (!err)
+		err = user_cache_maint(client, &op);
+
+	up_read(&current->mm->mmap_sem);
+	return err;
+}
+
+static void inner_flush_cache_all(void *unused)
+{
+	flush_cache_all();
+}
+
+static enum dma_data_direction cache_op_dir(unsigned int op)
+{
+	if (op == NVMAP_CACHE_OP_WB_INV)
+		return DMA_BIDIRECTIONAL;
+	else if (op == NVMAP_CACHE_OP_WB)
+		return DMA_TO_DEVICE;
+	else
+		return DMA_FROM_DEVICE;
+}
+
+static void outer_maint_range(unsigned long start, unsigned long end,
+			      enum dma_data_direction dir)
+{
+	if (dir == DMA_TO_DEVICE)
+		outer_clean_range(start, end);
+	else if (dir == DMA_FROM_DEVICE)
+		outer_inv_range(start, end);
+	else
+		outer_flush_range(start, end);
+}
+
+/* maintains the outer cache for the range [start, end) of h. the caller
+ * must keep the compactor from moving the handle */
+static void outer_cache_maint(struct nvmap_handle *h, unsigned long start,
+			      unsigned long end, enum dma_data_direction dir)
+{
+	if (h->flags == NVMAP_HANDLE_INNER_CACHEABLE)
+		return;
+
+	if (end - start >= cache_maint_outer_threshold) {
+		outer_flush_all();
+		return;
+	}
+
+	if (!h->heap_pgalloc) {
+		outer_maint_range(h->carveout->base + start,
+				  h->carveout->base + end, dir);
+		return;
+	}
+
+	while (start < end) {
+		unsigned long next = (start + PAGE_SIZE) & PAGE_MASK;
+		unsigned long phys;
+
+		next = min(next, end);
+		phys = page_to_phys(h->pgalloc.pages[start >> PAGE_SHIFT]);
+		phys += start & ~PAGE_MASK;
+		outer_maint_range(phys, phys + (next - start), dir);
+		start = next;
+	}
+}
+
+/* runs the outer cache part of either the invalidate entries of a list,
+ * or of the rest of them */
+static void cache_list_outer(struct nvmap_cache_op *ops, unsigned int count,
+			     bool outer_all, bool inv)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		struct nvmap_handle *h = (struct nvmap_handle *)ops[i].handle;
+
+		if ((ops[i].op == NVMAP_CACHE_OP_INV) != inv ||
+		    !cache_op_maintains(h) ||
+		    h->flags == NVMAP_HANDLE_INNER_CACHEABLE)
+			continue;
+
+		if (outer_all) {
+			outer_flush_all();
+			return;
+		}
+
+		nvmap_carveout_lock(h);
+		outer_cache_maint(h, ops[i].addr, ops[i].addr + ops[i].len,
+				  cache_op_dir(ops[i].op));
+		nvmap_carveout_unlock(h);
+	}
+}
+
+/* a single flush of the inner caches covers every entry of the list. the
+ * outer cache is invalidated first, so that lines dropped from L1 can't be
+ * refilled with stale data from L2, and cleaned after the inner flush has
+ * written dirty lines back to it */
+static void cache_list_maint_all(struct nvmap_cache_op *ops,
+				 unsigned int count, bool outer_all)
+{
+	cache_list_outer(ops, count, outer_all, true);
+	on_each_cpu(inner_flush_cache_all, NULL, 1);
+	cache_list_outer(ops, count, outer_all, false);
+	wmb();
+}
+
+int nvmap_ioctl_cache_maint_list(struct file *filp, void __user *arg)
+{
+	struct nvmap_client *client = filp->private_data;
+	struct nvmap_cache_op on_stack[8];
+	struct nvmap_cache_list list;
+	struct nvmap_cache_op *ops;
+	unsigned long total = 0;
+	unsigned int count;
+	unsigned int i;
+	int err = 0;
+
+	if (copy_from_user(&list, arg, sizeof(list)))
+		return -EFAULT;
+
+	if (!list.count || list.count > NVMAP_CACHE_LIST_MAX)
 		return -EINVAL;
 
+	if (list.count > ARRAY_SIZE(on_stack))
+		ops = kmalloc(list.count * sizeof(*ops), GFP_KERNEL);
+	else
+		ops = on_stack;
+
+	if (!ops)
+		return -ENOMEM;
+
+	if (copy_from_user(ops, (void *)list.ops,
+			   list.count * sizeof(*ops))) {
+		err = -EFAULT;
+		goto free;
+	}
+
 	down_read(&current->mm->mmap_sem);
 
-	vma = find_vma(current->active_mm, (unsigned long)op.addr);
-	if (!vma || !is_nvmap_vma(vma) ||
-	    (unsigned long)op.addr + op.len > vma->vm_end) {
-		err = -EADDRNOTAVAIL;
+	/* validate the whole list before maintaining any of it */
+	for (i = 0; i < list.count && !err; i++)
+		err = cache_op_lookup(&ops[i]);
+
+	if (err)
 		goto out;
-	}
 
-	vpriv = (struct nvmap_vma_priv *)vma->vm_private_data;
+	/* drop the entries that need no maintenance, so that they don't count
+	 * towards the whole-cache thresholds */
+	for (i = 0, count = 0; i < list.count; i++) {
+		struct nvmap_handle *h = (struct nvmap_handle *)ops[i].handle;
 
-	if ((unsigned long)vpriv->handle != op.handle) {
-		err = -EFAULT;
+		if (h->alloc && !cache_op_needed(h, ops[i].op))
+			continue;
+
+		if (h->alloc)
+			total += ops[i].len;
+		ops[count] = ops[i];
+		count++;
+	}
+
+	if (total >= cache_maint_inner_threshold) {
+		cache_list_maint_all(ops, count,
+				     total >= cache_maint_outer_threshold);
 		goto out;
 	}
 
-	start = (unsigned long)op.addr - vma->vm_start;
-	end = start + op.len;
+	for (i = 0; i < count && !err; i++)
+		err = user_cache_maint(client, &ops[i]);
 
-	err = cache_maint(client, vpriv->handle, start, end, op.op);
 out:
 	up_read(&current->mm->mmap_sem);
+free:
+	if (ops != on_stack)
+		kfree(ops);
 	return err;
 }
 
@@ -463,12 +677,22 @@ static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 	    start == end)
 		goto out;
 
-	if (op == NVMAP_CACHE_OP_WB_INV)
-		dir = DMA_BIDIRECTIONAL;
-	else if (op == NVMAP_CACHE_OP_WB)
-		dir = DMA_TO_DEVICE;
-	else
-		dir = DMA_FROM_DEVICE;
+	if (start > h->size || end > h->size) {
+		nvmap_warn(client, "cache maintenance outside handle\n");
+		err = -EINVAL;
+		goto out;
+	}
+
+	dir = cache_op_dir(op);
+
+	if (end - start >= cache_maint_inner_threshold) {
+		if (dir == DMA_FROM_DEVICE)
+			outer_cache_maint(h, start, end, dir);
+		on_each_cpu(inner_flush_cache_all, NULL, 1);
+		if (dir != DMA_FROM_DEVICE)
+			outer_cache_maint(h, start, end, dir);
+		goto out;
+	}
 
 	if (h->heap_pgalloc) {
 		while (start < end) {
@@ -492,35 +716,23 @@ static int cache_maint(struct nvmap_client *client, struct nvmap_handle *h,
 		goto out;
 	}
 
-	if (start > h->size || end > h->size) {
-		nvmap_warn(client, "cache maintenance outside handle\n");
-		return -EINVAL;
-	}
-
-	start += h->carveout->base;
-	end += h->carveout->base;
-
 	loop = start;
 
 	while (loop < end) {
-		unsigned long next = (loop + PAGE_SIZE) & PAGE_MASK;
-		void *base = (void *)kaddr + (loop & ~PAGE_MASK);
-		next = min(next, end);
+		unsigned long phys = h->carveout->base + loop;
+		unsigned long next = (phys + PAGE_SIZE) & PAGE_MASK;
+		void *base = (void *)kaddr + (phys & ~PAGE_MASK);
+		next = min(next, h->carveout->base + end);
 
 		set_pte_at(&init_mm, kaddr, *pte,
-			   pfn_pte(__phys_to_pfn(loop), prot));
+			   pfn_pte(__phys_to_pfn(phys), prot));
 		flush_tlb_kernel_page(kaddr);
 
-		dmac_map_area(base, next - loop, dir);
-		loop = next;
+		dmac_map_area(base, next - phys, dir);
+		loop += next - phys;
 	}
 
-	if (h->flags != NVMAP_HANDLE_INNER_CACHEABLE) {
-		if (dir != DMA_FROM_DEVICE)
-			outer_clean_range(start, end);
-		else
-			outer_inv_range(start, end);
-	}
+	outer_cache_maint(h, start, end, dir);
 
 out:
 	if (pte)
@@ -576,6 +788,9 @@ static int rw_handle_page(struct nvmap_handle *h, int is_read,
 			put_page(page);
 	}
 
+	if (!is_read)
+		nvmap_handle_mark_dirty(h);
+
 	return err;
 }
 
@@ -607,6 +822,7 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 	if (IS_ERR(pte))
 		return PTR_ERR(pte);
 
+	nvmap_carveout_lock(h);
 	while (count--) {
 		if (h_offs + elem_size > h->size) {
 			nvmap_warn(client, "read/write outside of handle\n");
@@ -632,6 +848,7 @@ static ssize_t rw_handle(struct nvmap_client *client, struct nvmap_handle *h,
 		sys_addr += sys_stride;
 		h_offs += h_stride;
 	}
+	nvmap_carveout_unlock(h);
 
 	nvmap_free_pte(client->dev, pte);
 	return ret ?: copied;
@@ -95,6 +95,23 @@ struct nvmap_cache_op {
 	__s32 op;
 };
 
+/* record read for each client from the nvmap/client_stats debugfs file;
+ * sizes are the bytes committed by the client's handle references */
+struct nvmap_client_stats {
+	__u32 pid;		/* 0 for kernel clients */
+	char comm[16];		/* task name, or client name for the kernel */
+	__u32 carveout;
+	__u32 iovmm;
+	__u32 sysmem;
+};
+
+struct nvmap_cache_list {
+	unsigned long ops;	/* array of struct nvmap_cache_op */
+	__u32 count;		/* number of entries in ops */
+};
+
+#define NVMAP_CACHE_LIST_MAX	256	/* most entries in a nvmap_cache_list */
+
 #define NVMAP_IOC_MAGIC 'N'
 
 /* Creates a new memory handle. On input, the argument is the size of the new
@@ -134,7 +151,12 @@ struct nvmap_cache_op {
  * reference to the same handle */
 #define NVMAP_IOC_GET_ID  _IOWR(NVMAP_IOC_MAGIC, 13, struct nvmap_create_handle)
 
-#define NVMAP_IOC_MAXNR (_IOC_NR(NVMAP_IOC_GET_ID))
+/* Performs the cache maintenance for a list of cache operations; if the
+ * list covers enough memory, the whole of the CPU caches is flushed once
+ * instead of maintaining each range */
+#define NVMAP_IOC_CACHE_LIST _IOW(NVMAP_IOC_MAGIC, 14, struct nvmap_cache_list)
+
+#define NVMAP_IOC_MAXNR (_IOC_NR(NVMAP_IOC_CACHE_LIST))
 
 int nvmap_ioctl_pinop(struct file *filp, bool is_pin, void __user *arg);
 
@@ -152,6 +174,8 @@ int nvmap_map_into_caller_ptr(struct file *filp, void __user *arg);
 
 int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg);
 
+int nvmap_ioctl_cache_maint_list(struct file *filp, void __user *arg);
+
 int nvmap_ioctl_rw_handle(struct file *filp, int is_read, void __user* arg);
 
 
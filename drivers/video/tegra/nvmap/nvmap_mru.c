@@ -31,9 +31,12 @@
 #include "nvmap_mru.h"
 
 /* if IOVMM reclamation is enabled (CONFIG_NVMAP_RECLAIM_UNPINNED_VM),
- * unpinned handles are placed onto a most-recently-used eviction list;
- * multiple lists are maintained, segmented by size (sizes were chosen to
- * roughly correspond with common sizes for graphics surfaces).
+ * unpinned handles keep their IOVMM area and mapping, and are placed onto
+ * an eviction list; multiple lists are maintained, segmented by size (sizes
+ * were chosen to roughly correspond with common sizes for graphics
+ * surfaces). handles are added at the tail, so the least recently unpinned
+ * handle is evicted first, and the buffers that an application submits
+ * every frame stay mapped from one frame to the next.
  *
  * if a handle is located on the MRU list, then the code below may
  * steal its IOVMM area at any time to satisfy a pin operation if no
@@ -66,7 +69,25 @@ size_t nvmap_mru_vm_size(struct tegra_iovmm_client *iovmm)
 void nvmap_mru_insert_locked(struct nvmap_share *share, struct nvmap_handle *h)
 {
 	size_t len = h->pgalloc.area->iovm_length;
-	list_add(&h->pgalloc.mru_list, mru_list(share, len));
+	list_add_tail(&h->pgalloc.mru_list, mru_list(share, len));
+}
+
+/* pins a handle whose IOVMM area is still allocated, taking it off its MRU
+ * list if it was unpinned; returns false if the handle needs an area from
+ * nvmap_handle_iovmm. must be called inside the pin lock, with the MRU lock
+ * held */
+bool nvmap_mru_pin_cached_locked(struct nvmap_share *share,
+				 struct nvmap_handle *h)
+{
+	if (!h->pgalloc.area)
+		return false;
+
+	if (!atomic_read(&h->pin)) {
+		BUG_ON(list_empty(&h->pgalloc.mru_list));
+		list_del_init(&h->pgalloc.mru_list);
+	}
+	atomic_inc(&h->pin);
+	return true;
 }
 
 void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h)
@@ -84,8 +105,8 @@ void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h)
  *
  * if no existing allocation exists, try to allocate a new IOVMM area.
  *
- * if a new area can not be allocated, try to re-use the most-recently-unpinned
- * handle's allocation.
+ * if a new area can not be allocated, try to re-use the least-recently-
+ * unpinned handle's allocation.
  *
  * and if that fails, iteratively evict handles from the MRU lists and free
  * their allocations, until the new allocation succeeds.
@@ -121,7 +142,7 @@ struct tegra_iovmm_area *nvmap_handle_iovmm(struct nvmap_client *c,
 		INIT_LIST_HEAD(&h->pgalloc.mru_list);
 		return vm;
 	}
-	/* attempt to re-use the most recently unpinned IOVMM area in the
+	/* attempt to re-use the least recently unpinned IOVMM area in the
 	 * same size bin as the current handle. If that fails, iteratively
 	 * evict handles (starting from the current bin) until an allocation
 	 * succeeds or no more areas can be evicted */
@@ -53,6 +53,9 @@ void nvmap_mru_insert_locked(struct nvmap_share *share, struct nvmap_handle *h);
 
 void nvmap_mru_remove(struct nvmap_share *s, struct nvmap_handle *h);
 
+bool nvmap_mru_pin_cached_locked(struct nvmap_share *share,
+				 struct nvmap_handle *h);
+
 struct tegra_iovmm_area *nvmap_handle_iovmm(struct nvmap_client *c,
 					    struct nvmap_handle *h);
 
@@ -72,6 +75,12 @@ static inline void nvmap_mru_remove(struct nvmap_share *s,
                                     struct nvmap_handle *h)
 { }
 
+static inline bool nvmap_mru_pin_cached_locked(struct nvmap_share *share,
+					       struct nvmap_handle *h)
+{
+	return false;
+}
+
 static inline struct tegra_iovmm_area *nvmap_handle_iovmm(struct nvmap_client *c,
 							  struct nvmap_handle *h)
 {
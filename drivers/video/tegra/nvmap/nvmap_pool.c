@@ -0,0 +1,301 @@
+/*
+ * drivers/video/tegra/nvmap/nvmap_pool.c
+ *
+ * Page pools for nvmap system memory handles
+ *
+ * Copyright (c) 2011, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <linux/err.h>
+#include <linux/freezer.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+
+#include <asm/cacheflush.h>
+#include <asm/outercache.h>
+
+#include <mach/nvmap.h>
+
+#include "nvmap.h"
+#include "nvmap_pool.h"
+
+/* every page handed to a handle must be free of dirty cache lines, since
+ * the handle may be mapped uncached or write-combined and read by devices.
+ * cleaning each page as it is allocated puts an L1 and L2 flush of every
+ * page on the allocation path, so system memory handles take their pages
+ * from per-cache-attribute pools of pages that have already been cleaned.
+ *
+ * pages freed from uncached and write-combined handles go straight back
+ * onto their pool, since they were never written through a cacheable
+ * mapping. pages freed from cacheable handles are queued on the pool's
+ * dirty list and cleaned by the pool thread, which also refills a pool
+ * once an allocation takes it below half of fill_pages. the pools are
+ * released to the page allocator through a shrinker. */
+
+static unsigned int fill_pages = 128;
+module_param(fill_pages, uint, 0644);
+
+static unsigned int max_pages = 512;
+module_param(max_pages, uint, 0644);
+
+static inline bool pool_is_dirty_on_free(unsigned long flags)
+{
+	return flags == NVMAP_HANDLE_INNER_CACHEABLE ||
+	       flags == NVMAP_HANDLE_CACHEABLE;
+}
+
+static void pool_clean_page(struct page *page)
+{
+	unsigned long base = page_to_phys(page);
+
+	__flush_dcache_page(page_mapping(page), page);
+	outer_flush_range(base, base + PAGE_SIZE);
+}
+
+unsigned int nvmap_page_pool_alloc(struct nvmap_share *share,
+				   unsigned long flags,
+				   struct page **pages, unsigned int nr)
+{
+	struct nvmap_page_pool *pool;
+	unsigned int i = 0;
+	bool wake = false;
+
+	pool = &share->pools[flags & NVMAP_HANDLE_CACHE_FLAG];
+
+	spin_lock(&share->pool_lock);
+	while (i < nr && !list_empty(&pool->pages)) {
+		struct page *page;
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_del(&page->lru);
+		pages[i++] = page;
+	}
+	pool->npages -= i;
+	if (pool->npages < fill_pages / 2 && !pool->want_fill) {
+		pool->want_fill = true;
+		wake = true;
+	}
+	spin_unlock(&share->pool_lock);
+
+	if (wake)
+		wake_up_process(share->pool_thread);
+	return i;
+}
+
+unsigned int nvmap_page_pool_release(struct nvmap_share *share,
+				     unsigned long flags,
+				     struct page **pages, unsigned int nr)
+{
+	struct nvmap_page_pool *pool;
+	bool dirty = pool_is_dirty_on_free(flags);
+	unsigned int room;
+	unsigned int i;
+
+	pool = &share->pools[flags & NVMAP_HANDLE_CACHE_FLAG];
+
+	spin_lock(&share->pool_lock);
+	room = pool->npages + pool->ndirty;
+	room = (room < max_pages) ? max_pages - room : 0;
+	nr = min(nr, room);
+	for (i = 0; i < nr; i++)
+		list_add(&pages[i]->lru, dirty ? &pool->dirty : &pool->pages);
+	if (dirty)
+		pool->ndirty += nr;
+	else
+		pool->npages += nr;
+	spin_unlock(&share->pool_lock);
+
+	if (dirty && nr)
+		wake_up_process(share->pool_thread);
+	return nr;
+}
+
+static void pool_clean_dirty(struct nvmap_share *share,
+			     struct nvmap_page_pool *pool)
+{
+	LIST_HEAD(list);
+	struct page *page;
+	unsigned int nr;
+
+	spin_lock(&share->pool_lock);
+	list_splice_init(&pool->dirty, &list);
+	nr = pool->ndirty;
+	pool->ndirty = 0;
+	spin_unlock(&share->pool_lock);
+
+	if (!nr)
+		return;
+
+	list_for_each_entry(page, &list, lru) {
+		pool_clean_page(page);
+		cond_resched();
+	}
+
+	spin_lock(&share->pool_lock);
+	list_splice(&list, &pool->pages);
+	pool->npages += nr;
+	spin_unlock(&share->pool_lock);
+}
+
+static void pool_fill(struct nvmap_share *share, struct nvmap_page_pool *pool)
+{
+	unsigned int count;
+	bool want;
+
+	spin_lock(&share->pool_lock);
+	want = pool->want_fill;
+	pool->want_fill = false;
+	count = pool->npages + pool->ndirty;
+	spin_unlock(&share->pool_lock);
+
+	/* don't push the system into reclaim to fill a cache; if the
+	 * allocation fails, wait for the next allocation to try again */
+	while (want && count < fill_pages && !kthread_should_stop()) {
+		struct page *page;
+
+		page = alloc_page(GFP_NVMAP | __GFP_NORETRY);
+		if (!page)
+			break;
+		pool_clean_page(page);
+
+		spin_lock(&share->pool_lock);
+		list_add(&page->lru, &pool->pages);
+		pool->npages++;
+		count = pool->npages + pool->ndirty;
+		spin_unlock(&share->pool_lock);
+	}
+}
+
+static bool pool_has_work(struct nvmap_share *share)
+{
+	bool work = false;
+	int i;
+
+	spin_lock(&share->pool_lock);
+	for (i = 0; i < NVMAP_NUM_POOLS && !work; i++)
+		work = share->pools[i].ndirty || share->pools[i].want_fill;
+	spin_unlock(&share->pool_lock);
+	return work;
+}
+
+static int nvmap_page_pool_thread(void *data)
+{
+	struct nvmap_share *share = data;
+	int i;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		for (i = 0; i < NVMAP_NUM_POOLS; i++) {
+			pool_clean_dirty(share, &share->pools[i]);
+			pool_fill(share, &share->pools[i]);
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!pool_has_work(share) && !kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+		try_to_freeze();
+	}
+	return 0;
+}
+
+static int nvmap_page_pool_shrink(struct shrinker *shrinker, int nr_to_scan,
+				  gfp_t gfp_mask)
+{
+	struct nvmap_share *share;
+	struct page *page, *tmp;
+	LIST_HEAD(list);
+	int remaining = 0;
+	int i;
+
+	share = container_of(shrinker, struct nvmap_share, pool_shrinker);
+
+	spin_lock(&share->pool_lock);
+	for (i = 0; i < NVMAP_NUM_POOLS; i++) {
+		struct nvmap_page_pool *pool = &share->pools[i];
+
+		while (nr_to_scan > 0 && !list_empty(&pool->pages)) {
+			page = list_first_entry(&pool->pages, struct page, lru);
+			list_move(&page->lru, &list);
+			pool->npages--;
+			nr_to_scan--;
+		}
+		remaining += pool->npages;
+	}
+	spin_unlock(&share->pool_lock);
+
+	list_for_each_entry_safe(page, tmp, &list, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	return remaining;
+}
+
+int nvmap_page_pool_init(struct nvmap_share *share)
+{
+	int i;
+
+	spin_lock_init(&share->pool_lock);
+	for (i = 0; i < NVMAP_NUM_POOLS; i++) {
+		struct nvmap_page_pool *pool = &share->pools[i];
+		INIT_LIST_HEAD(&pool->pages);
+		INIT_LIST_HEAD(&pool->dirty);
+		pool->npages = 0;
+		pool->ndirty = 0;
+		pool->want_fill = true;
+	}
+
+	share->pool_thread = kthread_run(nvmap_page_pool_thread, share,
+					 "nvmap-pool");
+	if (IS_ERR(share->pool_thread)) {
+		int err = PTR_ERR(share->pool_thread);
+		share->pool_thread = NULL;
+		return err;
+	}
+
+	share->pool_shrinker.shrink = nvmap_page_pool_shrink;
+	share->pool_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&share->pool_shrinker);
+	return 0;
+}
+
+void nvmap_page_pool_destroy(struct nvmap_share *share)
+{
+	struct page *page, *tmp;
+	int i;
+
+	if (!share->pool_thread)
+		return;
+
+	unregister_shrinker(&share->pool_shrinker);
+	kthread_stop(share->pool_thread);
+	share->pool_thread = NULL;
+
+	for (i = 0; i < NVMAP_NUM_POOLS; i++) {
+		struct nvmap_page_pool *pool = &share->pools[i];
+
+		list_splice_init(&pool->dirty, &pool->pages);
+		list_for_each_entry_safe(page, tmp, &pool->pages, lru) {
+			list_del(&page->lru);
+			__free_page(page);
+		}
+		pool->npages = 0;
+		pool->ndirty = 0;
+	}
+}
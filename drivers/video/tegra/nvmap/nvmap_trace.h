@@ -0,0 +1,78 @@
+/*
+ * drivers/video/tegra/nvmap/nvmap_trace.h
+ *
+ * Tracepoints for nvmap handle lifetime
+ *
+ * Copyright (c) 2011, NVIDIA Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nvmap
+
+#if !defined(_NVMAP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _NVMAP_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct nvmap_client;
+struct nvmap_handle;
+
+/* client is NULL for kernel mappings made through nvmap_mmap; pid is 0 for
+ * those and for kernel clients. heap is the NVMAP_HEAP_* bit the handle is
+ * allocated from, or 0 if it has no memory yet */
+DECLARE_EVENT_CLASS(nvmap_handle_class,
+	TP_PROTO(struct nvmap_client *client, struct nvmap_handle *h),
+	TP_ARGS(client, h),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(const void *, handle)
+		__field(size_t, size)
+		__field(unsigned int, heap)
+		__field(unsigned long, flags)
+	),
+	TP_fast_assign(
+		__entry->pid = (client && client->task) ? client->task->pid : 0;
+		__entry->handle = h;
+		__entry->size = h->size;
+		__entry->heap = nvmap_handle_heap(h);
+		__entry->flags = h->flags;
+	),
+	TP_printk("pid=%d handle=%p size=%zu heap=0x%x flags=0x%lx",
+		  __entry->pid, __entry->handle, __entry->size,
+		  __entry->heap, __entry->flags)
+);
+
+#define DEFINE_NVMAP_HANDLE_EVENT(name)				\
+DEFINE_EVENT(nvmap_handle_class, name,				\
+	TP_PROTO(struct nvmap_client *client, struct nvmap_handle *h), \
+	TP_ARGS(client, h))
+
+DEFINE_NVMAP_HANDLE_EVENT(nvmap_create_handle);
+DEFINE_NVMAP_HANDLE_EVENT(nvmap_alloc_handle);
+DEFINE_NVMAP_HANDLE_EVENT(nvmap_free_handle);
+DEFINE_NVMAP_HANDLE_EVENT(nvmap_pin);
+DEFINE_NVMAP_HANDLE_EVENT(nvmap_unpin);
+DEFINE_NVMAP_HANDLE_EVENT(nvmap_mmap);
+
+#endif /* _NVMAP_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE nvmap_trace
+#include <trace/define_trace.h>
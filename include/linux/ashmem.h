@@ -32,6 +32,26 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/*
+ * One entry of an ASHMEM_PIN_BATCH call. 'cmd' is ASHMEM_PIN, ASHMEM_UNPIN
+ * or ASHMEM_GET_PIN_STATUS, and 'result' is set to what that ioctl would
+ * have returned for the same offset and len.
+ */
+struct ashmem_pin_op {
+	__u32 cmd;
+	__u32 offset;
+	__u32 len;
+	__s32 result;
+};
+
+struct ashmem_pin_batch {
+	__u64 ops;	/* user pointer to an array of struct ashmem_pin_op */
+	__u32 count;	/* number of entries, at most ASHMEM_PIN_BATCH_MAX */
+	__u32 pad;
+};
+
+#define ASHMEM_PIN_BATCH_MAX	256
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -44,5 +64,6 @@ struct ashmem_pin {
 #define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
 #define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+#define ASHMEM_PIN_BATCH	_IOW(__ASHMEMIOC, 11, struct ashmem_pin_batch)
 
 #endif	/* _LINUX_ASHMEM_H */
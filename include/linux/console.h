@@ -139,6 +139,7 @@ extern int update_console_cmdline(char *name, int idx, char *name_new, int idx_n
 extern void register_console(struct console *);
 extern int unregister_console(struct console *);
 extern struct console *console_drivers;
+extern int console_msg_level;
 extern void console_lock(void);
 extern int console_trylock(void);
 extern void console_unlock(void);
@@ -68,6 +68,33 @@ extern unsigned long badness(struct task_struct *p, struct mem_cgroup *mem,
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+/*
+ * Keep the lowmemorykiller's index of processes by oom_adj up to date.
+ * Must not be called with task_lock, siglock or tasklist_lock held.
+ */
+extern void lowmem_index_add(struct task_struct *task);
+extern void lowmem_index_del(struct task_struct *task);
+extern void lowmem_index_update(struct task_struct *task);
+/* Feed the lowmemorykiller's pressure estimate from page reclaim. */
+extern void lowmem_reclaim_stat(unsigned long scanned,
+				unsigned long reclaimed);
+#else
+static inline void lowmem_index_add(struct task_struct *task)
+{
+}
+static inline void lowmem_index_del(struct task_struct *task)
+{
+}
+static inline void lowmem_index_update(struct task_struct *task)
+{
+}
+static inline void lowmem_reclaim_stat(unsigned long scanned,
+				       unsigned long reclaimed)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
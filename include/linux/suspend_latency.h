@@ -0,0 +1,62 @@
+/* include/linux/suspend_latency.h
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef _LINUX_SUSPEND_LATENCY_H
+#define _LINUX_SUSPEND_LATENCY_H
+
+#include <linux/types.h>
+
+/* The step of a suspend or resume that a timed callback belongs to. */
+enum suspend_latency_phase {
+	SUSPEND_LATENCY_EARLY_SUSPEND,
+	SUSPEND_LATENCY_PM_NOTIFIER,
+	SUSPEND_LATENCY_DEV_SUSPEND,
+	SUSPEND_LATENCY_DEV_SUSPEND_NOIRQ,
+	SUSPEND_LATENCY_SYSCORE_SUSPEND,
+	SUSPEND_LATENCY_PLATFORM_ENTER,
+	SUSPEND_LATENCY_SYSCORE_RESUME,
+	SUSPEND_LATENCY_DEV_RESUME_NOIRQ,
+	SUSPEND_LATENCY_DEV_RESUME,
+	SUSPEND_LATENCY_LATE_RESUME,
+	SUSPEND_LATENCY_PHASES
+};
+
+#ifdef CONFIG_SUSPEND_LATENCY
+
+/*
+ * suspend_latency_begin and suspend_latency_end bracket a cycle: a suspend
+ * attempt, or a pass over the early suspend or late resume handlers.
+ * Callbacks timed with suspend_latency_start and suspend_latency_record
+ * outside of a cycle are not recorded.
+ */
+void suspend_latency_begin(const char *kind);
+void suspend_latency_end(int error);
+u64 suspend_latency_start(void);
+void suspend_latency_record(enum suspend_latency_phase phase, u64 start,
+			    int error, const char *fmt, ...)
+	__attribute__ ((format (printf, 4, 5)));
+
+#else
+
+static inline void suspend_latency_begin(const char *kind) {}
+static inline void suspend_latency_end(int error) {}
+static inline u64 suspend_latency_start(void) { return 0; }
+static inline void suspend_latency_record(enum suspend_latency_phase phase,
+					  u64 start, int error,
+					  const char *fmt, ...) {}
+
+#endif
+
+#endif
@@ -17,6 +17,7 @@
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/suspend_latency.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
@@ -93,10 +94,17 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
+	suspend_latency_begin("early_suspend");
 	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL)
+		if (pos->suspend != NULL) {
+			u64 start = suspend_latency_start();
+
 			pos->suspend(pos);
+			suspend_latency_record(SUSPEND_LATENCY_EARLY_SUSPEND,
+					       start, 0, "%pF", pos->suspend);
+		}
 	}
+	suspend_latency_end(0);
 	mutex_unlock(&early_suspend_lock);
 
 	if (debug_mask & DEBUG_SUSPEND)
@@ -131,9 +139,17 @@ static void late_resume(struct work_struct *work)
 	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
-	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
-		if (pos->resume != NULL)
+	suspend_latency_begin("late_resume");
+	list_for_each_entry_reverse(pos, &early_suspend_handlers, link) {
+		if (pos->resume != NULL) {
+			u64 start = suspend_latency_start();
+
 			pos->resume(pos);
+			suspend_latency_record(SUSPEND_LATENCY_LATE_RESUME,
+					       start, 0, "%pF", pos->resume);
+		}
+	}
+	suspend_latency_end(0);
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
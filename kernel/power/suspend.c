@@ -22,6 +22,7 @@
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/suspend.h>
+#include <linux/suspend_latency.h>
 #include <linux/syscore_ops.h>
 #include <trace/events/power.h>
 
@@ -174,7 +175,13 @@ static int suspend_enter(suspend_state_t state)
 	}
 	if (!error) {
 		if (!(suspend_test(TEST_CORE) || pm_wakeup_pending())) {
+			u64 start = suspend_latency_start();
+
 			error = suspend_ops->enter(state);
+			/* includes the time spent asleep, so it is not ranked */
+			suspend_latency_record(SUSPEND_LATENCY_PLATFORM_ENTER,
+					       start, error, "%pF",
+					       suspend_ops->enter);
 			events_check_enabled = false;
 		}
 		syscore_resume();
@@ -282,6 +289,8 @@ int enter_state(suspend_state_t state)
 	if (!mutex_trylock(&pm_mutex))
 		return -EBUSY;
 
+	suspend_latency_begin("suspend");
+
 	printk(KERN_INFO "PM: Syncing filesystems ... ");
 	sys_sync();
 	printk("done.\n");
@@ -303,6 +312,7 @@ int enter_state(suspend_state_t state)
 	pr_debug("PM: Finishing wakeup.\n");
 	suspend_finish();
  Unlock:
+	suspend_latency_end(error);
 	mutex_unlock(&pm_mutex);
 	return error;
 }
@@ -0,0 +1,279 @@
+/* kernel/power/suspend_latency.c
+ *
+ * Records how long each device, system core and early suspend callback
+ * took in the last few suspend and resume cycles, to find the drivers
+ * that make suspend or resume slow.
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/debugfs.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/suspend_latency.h>
+#include <linux/time.h>
+
+#define SUSPEND_LATENCY_CYCLES		8
+#define SUSPEND_LATENCY_ENTRIES		64
+#define SUSPEND_LATENCY_NAME_LEN	32
+
+struct suspend_latency_entry {
+	char name[SUSPEND_LATENCY_NAME_LEN];
+	u32 usecs;
+	int error;
+	enum suspend_latency_phase phase;
+};
+
+/*
+ * Every callback is added to its phase's totals, but only the slowest
+ * callbacks that took at least threshold_us are kept individually.  The
+ * platform enter includes the time spent asleep, so it is only counted in
+ * the totals, where it cannot push a slow callback out of the entries.
+ */
+struct suspend_latency_cycle {
+	unsigned int seq;
+	const char *kind;
+	struct timespec begin;
+	u64 start_ns;
+	u64 total_ns;
+	int error;
+	u64 phase_ns[SUSPEND_LATENCY_PHASES];
+	unsigned int phase_calls[SUSPEND_LATENCY_PHASES];
+	unsigned int nr_entries;
+	unsigned int dropped;
+	struct suspend_latency_entry entries[SUSPEND_LATENCY_ENTRIES];
+};
+
+static const char *suspend_latency_phase_names[SUSPEND_LATENCY_PHASES] = {
+	[SUSPEND_LATENCY_EARLY_SUSPEND] = "early_suspend",
+	[SUSPEND_LATENCY_PM_NOTIFIER] = "pm_notifier",
+	[SUSPEND_LATENCY_DEV_SUSPEND] = "dev_suspend",
+	[SUSPEND_LATENCY_DEV_SUSPEND_NOIRQ] = "dev_suspend_noirq",
+	[SUSPEND_LATENCY_SYSCORE_SUSPEND] = "syscore_suspend",
+	[SUSPEND_LATENCY_PLATFORM_ENTER] = "platform_enter",
+	[SUSPEND_LATENCY_SYSCORE_RESUME] = "syscore_resume",
+	[SUSPEND_LATENCY_DEV_RESUME_NOIRQ] = "dev_resume_noirq",
+	[SUSPEND_LATENCY_DEV_RESUME] = "dev_resume",
+	[SUSPEND_LATENCY_LATE_RESUME] = "late_resume",
+};
+
+static unsigned int threshold_us = 100;
+module_param(threshold_us, uint, S_IRUGO | S_IWUSR | S_IWGRP);
+
+static struct suspend_latency_cycle cycles[SUSPEND_LATENCY_CYCLES];
+static struct suspend_latency_cycle *current_cycle;
+static unsigned int cycle_seq;
+static DEFINE_SPINLOCK(suspend_latency_lock);
+
+void suspend_latency_begin(const char *kind)
+{
+	struct suspend_latency_cycle *cycle;
+	unsigned long flags;
+
+	spin_lock_irqsave(&suspend_latency_lock, flags);
+	cycle = &cycles[cycle_seq % SUSPEND_LATENCY_CYCLES];
+	memset(cycle, 0, sizeof(*cycle));
+	cycle->seq = cycle_seq++;
+	cycle->kind = kind;
+	getnstimeofday(&cycle->begin);
+	cycle->start_ns = local_clock();
+	current_cycle = cycle;
+	spin_unlock_irqrestore(&suspend_latency_lock, flags);
+}
+
+void suspend_latency_end(int error)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&suspend_latency_lock, flags);
+	if (current_cycle) {
+		current_cycle->total_ns = local_clock() -
+					  current_cycle->start_ns;
+		current_cycle->error = error;
+		current_cycle = NULL;
+	}
+	spin_unlock_irqrestore(&suspend_latency_lock, flags);
+}
+
+/*
+ * local_clock keeps running between the syscore callbacks, after
+ * timekeeping itself has been suspended.
+ */
+u64 suspend_latency_start(void)
+{
+	return local_clock();
+}
+
+static struct suspend_latency_entry *
+suspend_latency_slot(struct suspend_latency_cycle *cycle, u32 usecs)
+{
+	struct suspend_latency_entry *fastest;
+	int i;
+
+	if (cycle->nr_entries < SUSPEND_LATENCY_ENTRIES)
+		return &cycle->entries[cycle->nr_entries++];
+
+	fastest = &cycle->entries[0];
+	for (i = 1; i < SUSPEND_LATENCY_ENTRIES; i++)
+		if (cycle->entries[i].usecs < fastest->usecs)
+			fastest = &cycle->entries[i];
+	cycle->dropped++;
+	return fastest->usecs < usecs ? fastest : NULL;
+}
+
+void suspend_latency_record(enum suspend_latency_phase phase, u64 start,
+			    int error, const char *fmt, ...)
+{
+	struct suspend_latency_entry *entry;
+	char name[SUSPEND_LATENCY_NAME_LEN];
+	unsigned int threshold = ACCESS_ONCE(threshold_us);
+	unsigned long flags;
+	va_list args;
+	bool keep;
+	u64 delta;
+	u32 usecs;
+
+	delta = local_clock() - start;
+	usecs = min_t(u64, div_u64(delta, NSEC_PER_USEC), UINT_MAX);
+	keep = usecs >= threshold && phase != SUSPEND_LATENCY_PLATFORM_ENTER;
+	if (keep) {
+		va_start(args, fmt);
+		vsnprintf(name, sizeof(name), fmt, args);
+		va_end(args);
+	}
+
+	spin_lock_irqsave(&suspend_latency_lock, flags);
+	if (!current_cycle)
+		goto out;
+	current_cycle->phase_ns[phase] += delta;
+	current_cycle->phase_calls[phase]++;
+	if (!keep)
+		goto out;
+	entry = suspend_latency_slot(current_cycle, usecs);
+	if (!entry)
+		goto out;
+	memcpy(entry->name, name, sizeof(entry->name));
+	entry->usecs = usecs;
+	entry->error = error;
+	entry->phase = phase;
+out:
+	spin_unlock_irqrestore(&suspend_latency_lock, flags);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int suspend_latency_cmp(const void *a, const void *b)
+{
+	const struct suspend_latency_entry *ea = a, *eb = b;
+
+	if (ea->usecs != eb->usecs)
+		return ea->usecs < eb->usecs ? 1 : -1;
+	return 0;
+}
+
+static void suspend_latency_show_cycle(struct seq_file *s,
+				       struct suspend_latency_cycle *cycle)
+{
+	int i;
+
+	seq_printf(s, "cycle %u %s at %ld.%06ld: %llu usecs, error %d\n",
+		   cycle->seq, cycle->kind, cycle->begin.tv_sec,
+		   cycle->begin.tv_nsec / NSEC_PER_USEC,
+		   div_u64(cycle->total_ns, NSEC_PER_USEC), cycle->error);
+	for (i = 0; i < SUSPEND_LATENCY_PHASES; i++) {
+		if (!cycle->phase_calls[i])
+			continue;
+		seq_printf(s, "  %-18s %5u calls %10llu usecs\n",
+			   suspend_latency_phase_names[i],
+			   cycle->phase_calls[i],
+			   div_u64(cycle->phase_ns[i], NSEC_PER_USEC));
+	}
+
+	sort(cycle->entries, cycle->nr_entries, sizeof(cycle->entries[0]),
+	     suspend_latency_cmp, NULL);
+	for (i = 0; i < cycle->nr_entries; i++) {
+		struct suspend_latency_entry *entry = &cycle->entries[i];
+
+		seq_printf(s, "    %-18s %10u usecs %4d %s\n",
+			   suspend_latency_phase_names[entry->phase],
+			   entry->usecs, entry->error, entry->name);
+	}
+	if (cycle->dropped)
+		seq_printf(s, "    (%u faster callbacks not listed)\n",
+			   cycle->dropped);
+}
+
+/* Oldest cycle first; each is copied so no lock is held while printing. */
+static int suspend_latency_show(struct seq_file *s, void *data)
+{
+	struct suspend_latency_cycle *copy;
+	unsigned long flags;
+	unsigned int seq, end;
+
+	copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&suspend_latency_lock, flags);
+	end = cycle_seq;
+	spin_unlock_irqrestore(&suspend_latency_lock, flags);
+
+	seq = end > SUSPEND_LATENCY_CYCLES ? end - SUSPEND_LATENCY_CYCLES : 0;
+	for (; seq != end; seq++) {
+		spin_lock_irqsave(&suspend_latency_lock, flags);
+		*copy = cycles[seq % SUSPEND_LATENCY_CYCLES];
+		spin_unlock_irqrestore(&suspend_latency_lock, flags);
+
+		/* Overwritten by a newer cycle since we started. */
+		if (copy->seq != seq)
+			continue;
+		suspend_latency_show_cycle(s, copy);
+	}
+
+	kfree(copy);
+	return 0;
+}
+
+static int suspend_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, suspend_latency_show, NULL);
+}
+
+static const struct file_operations suspend_latency_fops = {
+	.open		= suspend_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init suspend_latency_init(void)
+{
+	struct dentry *d;
+
+	d = debugfs_create_file("suspend_latency", 0444, NULL, NULL,
+				&suspend_latency_fops);
+	if (!d) {
+		pr_err("Failed to create suspend_latency debug file\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+late_initcall(suspend_latency_init);
+#endif
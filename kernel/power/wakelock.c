@@ -15,7 +15,9 @@
 
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/rbtree.h>
 #include <linux/rtc.h>
+#include <linux/slab.h>
 #include <linux/suspend.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
@@ -43,6 +45,14 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+
+/*
+ * Active locks of each type are also counted, if they have no timeout, or
+ * kept in a tree ordered by expiry, so that has_wake_lock does not have to
+ * walk active_wake_locks. Both are protected by list_lock.
+ */
+static int active_nolimit_count[WAKE_LOCK_TYPE_COUNT];
+static struct rb_root active_timeouts[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
@@ -54,6 +64,20 @@ static struct wake_lock deleted_wake_locks;
 static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
+/*
+ * Every initialized lock, in the order it was initialized. Unlike the
+ * inactive and active lists a lock never moves on it, so the stats reader
+ * can walk it a batch at a time, keeping its place with a cursor.
+ */
+static LIST_HEAD(all_wake_locks);
+
+#define WAKELOCK_STAT_BATCH	16
+
+struct wakelock_stat_snapshot {
+	struct wake_lock lock;
+	char name[48];
+};
+
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
 	struct timespec ts;
@@ -114,24 +138,55 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 		     ktime_to_ns(lock->stat.last_time));
 }
 
+/*
+ * Interrupts are only disabled while a batch of locks is copied, not while
+ * the whole list is walked and formatted.
+ */
 static int wakelock_stats_show(struct seq_file *m, void *unused)
 {
 	unsigned long irqflags;
+	struct wakelock_stat_snapshot *snap;
+	struct wake_lock cursor;
 	struct wake_lock *lock;
-	int ret;
-	int type;
+	int n;
+	int i;
 
-	spin_lock_irqsave(&list_lock, irqflags);
+	snap = kmalloc(sizeof(*snap) * WAKELOCK_STAT_BATCH, GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
 
-	ret = seq_puts(m, "name\tcount\texpire_count\twake_count\tactive_since"
+	seq_puts(m, "name\tcount\texpire_count\twake_count\tactive_since"
 			"\ttotal_time\tsleep_time\tmax_time\tlast_change\n");
-	list_for_each_entry(lock, &inactive_locks, link)
-		ret = print_lock_stat(m, lock);
-	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
-		list_for_each_entry(lock, &active_wake_locks[type], link)
-			ret = print_lock_stat(m, lock);
-	}
+
+	/* The cursor is never initialized, so other readers skip it. */
+	cursor.flags = 0;
+	spin_lock_irqsave(&list_lock, irqflags);
+	list_add(&cursor.stat_link, &all_wake_locks);
+	do {
+		n = 0;
+		lock = &cursor;
+		list_for_each_entry_continue(lock, &all_wake_locks, stat_link) {
+			if (!(lock->flags & WAKE_LOCK_INITIALIZED))
+				continue;
+			snap[n].lock = *lock;
+			strlcpy(snap[n].name, lock->name, sizeof(snap[n].name));
+			snap[n].lock.name = snap[n].name;
+			if (++n == WAKELOCK_STAT_BATCH)
+				break;
+		}
+		if (n == WAKELOCK_STAT_BATCH)
+			list_move(&cursor.stat_link, &lock->stat_link);
+		spin_unlock_irqrestore(&list_lock, irqflags);
+
+		for (i = 0; i < n; i++)
+			print_lock_stat(m, &snap[i].lock);
+
+		spin_lock_irqsave(&list_lock, irqflags);
+	} while (n == WAKELOCK_STAT_BATCH);
+	list_del(&cursor.stat_link);
 	spin_unlock_irqrestore(&list_lock, irqflags);
+
+	kfree(snap);
 	return 0;
 }
 
@@ -188,12 +243,48 @@ static void update_sleep_wait_stats_locked(int done)
 }
 #endif
 
+/* Caller must acquire the list_lock spinlock */
+static void active_add_locked(struct wake_lock *lock, int type)
+{
+	struct rb_node **p = &active_timeouts[type].rb_node;
+	struct rb_node *parent = NULL;
+
+	if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE)) {
+		active_nolimit_count[type]++;
+		return;
+	}
+
+	while (*p) {
+		struct wake_lock *entry;
+
+		parent = *p;
+		entry = rb_entry(parent, struct wake_lock, timeout_node);
+		if (time_before(lock->expires, entry->expires))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&lock->timeout_node, parent, p);
+	rb_insert_color(&lock->timeout_node, &active_timeouts[type]);
+}
+
+/* Caller must acquire the list_lock spinlock */
+static void active_del_locked(struct wake_lock *lock, int type)
+{
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return;
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		rb_erase(&lock->timeout_node, &active_timeouts[type]);
+	else
+		active_nolimit_count[type]--;
+}
 
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
+	active_del_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -226,21 +317,23 @@ static void print_active_locks(int type)
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct rb_node *node;
+	struct wake_lock *lock;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	if (active_nolimit_count[type])
+		return -1;
+	while ((node = rb_first(&active_timeouts[type]))) {
+		lock = rb_entry(node, struct wake_lock, timeout_node);
+		if ((long)(lock->expires - jiffies) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	node = rb_last(&active_timeouts[type]);
+	if (!node)
+		return 0;
+	lock = rb_entry(node, struct wake_lock, timeout_node);
+	return lock->expires - jiffies;
 }
 
 long has_wake_lock(int type)
@@ -354,6 +447,9 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	INIT_LIST_HEAD(&lock->link);
 	spin_lock_irqsave(&list_lock, irqflags);
 	list_add(&lock->link, &inactive_locks);
+#ifdef CONFIG_WAKELOCK_STAT
+	list_add_tail(&lock->stat_link, &all_wake_locks);
+#endif
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_init);
@@ -364,8 +460,10 @@ void wake_lock_destroy(struct wake_lock *lock)
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
+	active_del_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
 	lock->flags &= ~WAKE_LOCK_INITIALIZED;
 #ifdef CONFIG_WAKELOCK_STAT
+	list_del(&lock->stat_link);
 	if (lock->stat.count) {
 		deleted_wake_locks.stat.count += lock->stat.count;
 		deleted_wake_locks.stat.expire_count += lock->stat.expire_count;
@@ -409,6 +507,7 @@ static void wake_lock_internal(
 		lock->stat.last_time = ktime_get();
 	}
 #endif
+	active_del_locked(lock, type);
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
@@ -424,12 +523,14 @@ static void wake_lock_internal(
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
 		list_add_tail(&lock->link, &active_wake_locks[type]);
+		active_add_locked(lock, type);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
 		list_add(&lock->link, &active_wake_locks[type]);
+		active_add_locked(lock, type);
 	}
 	if (type == WAKE_LOCK_SUSPEND) {
 		current_event_num++;
@@ -483,6 +584,7 @@ void wake_unlock(struct wake_lock *lock)
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	active_del_locked(lock, type);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -537,8 +639,10 @@ static int __init wakelocks_init(void)
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		active_timeouts[i] = RB_ROOT;
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
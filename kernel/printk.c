@@ -88,6 +88,14 @@ static DEFINE_SEMAPHORE(console_sem);
 struct console *console_drivers;
 EXPORT_SYMBOL_GPL(console_drivers);
 
+/*
+ * Log level of the text currently being handed to the console drivers,
+ * for consoles that record it alongside the message.  Only valid inside
+ * a console's ->write() method.
+ */
+int console_msg_level = -1;
+EXPORT_SYMBOL_GPL(console_msg_level);
+
 /*
  * This is used for debugging the mess that is the VT code by
  * keeping track if we have the console semaphore held. It's
@@ -561,6 +569,7 @@ static void _call_console_drivers(unsigned start,
 {
 	if ((msg_log_level < console_loglevel || ignore_loglevel) &&
 			console_drivers && start != end) {
+		console_msg_level = msg_log_level;
 		if ((start & LOG_BUF_MASK) > (end & LOG_BUF_MASK)) {
 			/* wrapped write */
 			__call_console_drivers(start & LOG_BUF_MASK,
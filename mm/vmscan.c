@@ -1944,6 +1944,8 @@ restart:
 			break;
 	}
 	sc->nr_reclaimed += nr_reclaimed;
+	if (scanning_global_lru(sc))
+		lowmem_reclaim_stat(sc->nr_scanned - nr_scanned, nr_reclaimed);
 
 	/*
 	 * Even if we did not try to evict anon pages at all, we want to
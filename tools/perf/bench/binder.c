@@ -0,0 +1,874 @@
+/*
+ *
+ * binder.c
+ *
+ * latency, oneway: Benchmarks for the Android binder IPC driver
+ *
+ * Every run forks one server and one client process per pair.  The perf
+ * process itself becomes the binder context manager and hands out the
+ * server handles, so no Android userspace (servicemanager) is needed.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../../../drivers/staging/android/binder.h"
+
+#define BINDER_DEV		"/dev/binder"
+#define BINDER_MAP_SIZE		(1024 * 1024)
+
+/* transaction codes understood by the context manager */
+#define CODE_REGISTER		1
+#define CODE_LOOKUP		2
+
+/* transaction codes understood by the servers */
+#define CODE_ECHO		1
+#define CODE_EXIT		2
+
+static unsigned int loops = 10000;
+static unsigned int pairs = 1;
+static unsigned int threads = 1;
+static unsigned int req_size = 32;
+static unsigned int reply_size;
+static bool pass_fd;
+
+static const struct option options[] = {
+	OPT_UINTEGER('l', "loop", &loops,
+		     "Specify number of transactions per client thread"),
+	OPT_UINTEGER('p', "pairs", &pairs,
+		     "Specify number of client/server process pairs"),
+	OPT_UINTEGER('t', "threads", &threads,
+		     "Specify number of client and server threads per pair"),
+	OPT_UINTEGER('s', "size", &req_size,
+		     "Specify transaction payload size in bytes"),
+	OPT_UINTEGER('r', "reply-size", &reply_size,
+		     "Specify reply payload size in bytes (latency only)"),
+	OPT_BOOLEAN('F', "fd", &pass_fd,
+		    "Pass a file descriptor with every transaction"),
+	OPT_END()
+};
+
+static const char * const bench_binder_latency_usage[] = {
+	"perf bench binder latency <options>",
+	NULL
+};
+
+static const char * const bench_binder_oneway_usage[] = {
+	"perf bench binder oneway <options>",
+	NULL
+};
+
+/*
+ * Latency histogram: 16 linear sub-buckets per power of two, which keeps
+ * the percentiles within ~6% of the real value.
+ */
+#define HIST_SUB_BITS		4
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		(64 * HIST_SUB)
+
+struct histogram {
+	u64 count[HIST_BUCKETS];
+	u64 nr;
+	u64 sum;
+	u64 min;
+	u64 max;
+	u64 retries;
+};
+
+static unsigned int hist_index(u64 v)
+{
+	int msb;
+
+	if (v < HIST_SUB)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static u64 hist_value(unsigned int idx)
+{
+	unsigned int group = idx / HIST_SUB, sub = idx % HIST_SUB;
+
+	if (!group)
+		return sub;
+	return (u64)(HIST_SUB + sub) << (group - 1);
+}
+
+static void hist_init(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = ~0ULL;
+}
+
+static void hist_add(struct histogram *h, u64 ns)
+{
+	h->count[hist_index(ns)]++;
+	h->nr++;
+	h->sum += ns;
+	if (ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+static void hist_merge(struct histogram *to, struct histogram *from)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->count[i] += from->count[i];
+	to->nr += from->nr;
+	to->sum += from->sum;
+	to->retries += from->retries;
+	if (from->min < to->min)
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+static u64 hist_percentile(struct histogram *h, double pct)
+{
+	u64 want = (u64)(h->nr * pct / 100.0), seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen > want)
+			return hist_value(i);
+	}
+	return h->max;
+}
+
+static void hist_print(struct histogram *h)
+{
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	u64 group[64] = { 0 }, peak = 0;
+	int i, first = -1, last = 0;
+
+	if (!h->nr)
+		return;
+
+	printf(" %14s: %.3f usecs\n", "min", h->min / 1000.0);
+	printf(" %14s: %.3f usecs\n", "avg", (double)h->sum / h->nr / 1000.0);
+	for (i = 0; i < (int)ARRAY_SIZE(pct); i++)
+		printf(" %13gth: %.3f usecs\n", pct[i],
+		       hist_percentile(h, pct[i]) / 1000.0);
+	printf(" %14s: %.3f usecs\n\n", "max", h->max / 1000.0);
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		group[i / HIST_SUB] += h->count[i];
+	for (i = 0; i < 64; i++) {
+		if (!group[i])
+			continue;
+		if (first < 0)
+			first = i;
+		last = i;
+		if (group[i] > peak)
+			peak = group[i];
+	}
+
+	printf(" %23s : %-10s distribution\n", "usecs", "count");
+	for (i = first; i <= last; i++) {
+		char bar[41];
+		int len = group[i] * 40 / peak;
+
+		memset(bar, '*', len);
+		bar[len] = '\0';
+		printf(" %10.3f -> %-10.3f : %-10llu |%-40s|\n",
+		       hist_value(i * HIST_SUB) / 1000.0,
+		       hist_value((i + 1) * HIST_SUB) / 1000.0,
+		       (unsigned long long)group[i], bar);
+	}
+}
+
+static void barf(const char *msg)
+{
+	fprintf(stderr, "%s (error: %s)\n", msg, strerror(errno));
+	exit(1);
+}
+
+/*
+ * Per-thread binder connection: commands are queued in wbuf and flushed
+ * together with the next read, so the BC_FREE_BUFFER for the previous
+ * reply rides along with the next transaction like libbinder does.
+ */
+struct binder_io {
+	int fd;
+	size_t wlen;
+	uint8_t wbuf[256];
+	uint8_t rbuf[256];
+	size_t rlen;
+	size_t rpos;
+};
+
+static int binder_fd;
+
+static void binder_io_init(struct binder_io *io)
+{
+	memset(io, 0, sizeof(*io));
+	io->fd = binder_fd;
+}
+
+static void put_cmd(struct binder_io *io, uint32_t cmd,
+		    const void *arg, size_t len)
+{
+	if (io->wlen + sizeof(cmd) + len > sizeof(io->wbuf))
+		barf("binder: command buffer overflow");
+	memcpy(io->wbuf + io->wlen, &cmd, sizeof(cmd));
+	io->wlen += sizeof(cmd);
+	memcpy(io->wbuf + io->wlen, arg, len);
+	io->wlen += len;
+}
+
+static void put_ptr(struct binder_io *io, uint32_t cmd, const void *ptr)
+{
+	put_cmd(io, cmd, &ptr, sizeof(ptr));
+}
+
+static void put_u32(struct binder_io *io, uint32_t cmd, uint32_t val)
+{
+	put_cmd(io, cmd, &val, sizeof(val));
+}
+
+/* flush queued commands, optionally reading back driver returns */
+static int binder_io_xfer(struct binder_io *io, bool do_read)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	bwr.write_size = io->wlen;
+	bwr.write_consumed = 0;
+	bwr.write_buffer = (unsigned long)io->wbuf;
+	bwr.read_size = do_read ? sizeof(io->rbuf) : 0;
+	bwr.read_consumed = 0;
+	bwr.read_buffer = (unsigned long)io->rbuf;
+
+	do {
+		ret = ioctl(io->fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+
+	io->wlen = 0;
+	io->rlen = bwr.read_consumed;
+	io->rpos = 0;
+	return 0;
+}
+
+static void *get_arg(struct binder_io *io, size_t len)
+{
+	void *p = io->rbuf + io->rpos;
+
+	if (io->rpos + len > io->rlen)
+		barf("binder: truncated return");
+	io->rpos += len;
+	return p;
+}
+
+/*
+ * Pull the next interesting return out of the read buffer, dealing with
+ * the reference counting and bookkeeping returns on the way.  Returns 0
+ * when the read buffer is exhausted.
+ */
+static uint32_t next_return(struct binder_io *io,
+			    struct binder_transaction_data *tr)
+{
+	while (io->rpos + sizeof(uint32_t) <= io->rlen) {
+		uint32_t cmd = *(uint32_t *)get_arg(io, sizeof(uint32_t));
+		struct binder_ptr_cookie *pc;
+
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_SPAWN_LOOPER:
+		case BR_OK:
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE:
+			pc = get_arg(io, sizeof(*pc));
+			put_cmd(io, cmd == BR_INCREFS ?
+				BC_INCREFS_DONE : BC_ACQUIRE_DONE,
+				pc, sizeof(*pc));
+			break;
+		case BR_RELEASE:
+		case BR_DECREFS:
+			get_arg(io, sizeof(struct binder_ptr_cookie));
+			break;
+		case BR_DEAD_BINDER:
+		case BR_CLEAR_DEATH_NOTIFICATION_DONE:
+			get_arg(io, sizeof(void *));
+			break;
+		case BR_ERROR:
+			get_arg(io, sizeof(int));
+			return cmd;
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(tr, get_arg(io, sizeof(*tr)), sizeof(*tr));
+			return cmd;
+		default:
+			return cmd;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send a transaction and wait until the driver reports its completion:
+ * BR_REPLY for synchronous calls, BR_TRANSACTION_COMPLETE for one-way
+ * ones.  The reply buffer is returned in @reply and must be released
+ * with free_buffer().
+ */
+static uint32_t binder_call(struct binder_io *io, uint32_t handle,
+			    uint32_t code, const void *data, size_t size,
+			    const size_t *offsets, size_t offsets_size,
+			    uint32_t flags, struct binder_transaction_data *reply)
+{
+	struct binder_transaction_data tr;
+	uint32_t cmd;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.flags = flags;
+	tr.data_size = size;
+	tr.offsets_size = offsets_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offsets;
+	put_cmd(io, BC_TRANSACTION, &tr, sizeof(tr));
+
+	for (;;) {
+		if (binder_io_xfer(io, true))
+			return BR_ERROR;
+		while ((cmd = next_return(io, reply))) {
+			/* anything else ends the call; callers check for
+			 * the return they expect */
+			if (cmd != BR_TRANSACTION_COMPLETE ||
+			    (flags & TF_ONE_WAY))
+				return cmd;
+		}
+	}
+}
+
+static void free_buffer(struct binder_io *io,
+			struct binder_transaction_data *tr)
+{
+	put_ptr(io, BC_FREE_BUFFER, tr->data.ptr.buffer);
+}
+
+static int binder_setup(bool context_mgr)
+{
+	struct binder_version version;
+	void *map;
+	int retry;
+
+	binder_fd = open(BINDER_DEV, O_RDWR);
+	if (binder_fd < 0)
+		return -errno;
+
+	if (ioctl(binder_fd, BINDER_VERSION, &version) < 0 ||
+	    version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder: protocol version mismatch\n");
+		return -EPROTO;
+	}
+
+	map = mmap(NULL, BINDER_MAP_SIZE, PROT_READ, MAP_PRIVATE,
+		   binder_fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	if (!context_mgr)
+		return 0;
+
+	/* the previous run's context manager is released asynchronously */
+	for (retry = 0; retry < 100; retry++) {
+		if (!ioctl(binder_fd, BINDER_SET_CONTEXT_MGR, 0))
+			return 0;
+		if (errno != EBUSY)
+			break;
+		usleep(10000);
+	}
+	return -errno;
+}
+
+/* context manager: a tiny name service mapping pair index to handle */
+
+struct register_req {
+	uint32_t index;
+	struct flat_binder_object obj;
+};
+
+static uint32_t *server_handles;
+static volatile int manager_stop;
+
+static void manager_transaction(struct binder_io *io,
+				struct binder_transaction_data *tr)
+{
+	const struct register_req *req = tr->data.ptr.buffer;
+	struct flat_binder_object obj;
+	size_t offset = 0;
+	struct binder_transaction_data reply;
+	uint32_t status = 0;
+
+	memset(&reply, 0, sizeof(reply));
+
+	if (tr->data_size < sizeof(uint32_t) || req->index >= pairs) {
+		status = -1;
+	} else if (tr->code == CODE_REGISTER &&
+		   tr->data_size >= sizeof(*req) &&
+		   req->obj.type == BINDER_TYPE_HANDLE) {
+		server_handles[req->index] = req->obj.handle;
+		/* keep the reference once the request buffer is freed */
+		put_u32(io, BC_ACQUIRE, req->obj.handle);
+	} else if (tr->code == CODE_LOOKUP &&
+		   server_handles[req->index] != 0) {
+		memset(&obj, 0, sizeof(obj));
+		obj.type = BINDER_TYPE_HANDLE;
+		obj.handle = server_handles[req->index];
+		reply.data_size = sizeof(obj);
+		reply.data.ptr.buffer = &obj;
+		reply.offsets_size = sizeof(offset);
+		reply.data.ptr.offsets = &offset;
+	} else {
+		status = -1;
+	}
+
+	if (!reply.data_size) {
+		reply.data_size = sizeof(status);
+		reply.data.ptr.buffer = &status;
+	}
+
+	free_buffer(io, tr);
+	put_cmd(io, BC_REPLY, &reply, sizeof(reply));
+	if (binder_io_xfer(io, false))
+		barf("manager: reply failed");
+}
+
+static void *manager_thread(void *arg __used)
+{
+	struct binder_io io;
+	struct binder_transaction_data tr;
+	struct pollfd pfd;
+	uint32_t cmd;
+
+	binder_io_init(&io);
+	put_cmd(&io, BC_ENTER_LOOPER, NULL, 0);
+	binder_io_xfer(&io, false);
+
+	pfd.fd = io.fd;
+	pfd.events = POLLIN;
+	while (!manager_stop) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (binder_io_xfer(&io, true))
+			break;
+		while ((cmd = next_return(&io, &tr))) {
+			if (cmd == BR_TRANSACTION)
+				manager_transaction(&io, &tr);
+		}
+	}
+	return NULL;
+}
+
+/* servers */
+
+static int server_exits;
+
+static void *server_thread(void *arg __used)
+{
+	struct binder_io io;
+	struct binder_transaction_data tr, reply;
+	static uint8_t reply_data[BINDER_MAP_SIZE / 4];
+	const struct flat_binder_object *obj;
+	uint32_t cmd;
+
+	binder_io_init(&io);
+	put_cmd(&io, BC_ENTER_LOOPER, NULL, 0);
+
+	for (;;) {
+		if (binder_io_xfer(&io, true))
+			barf("server: read failed");
+		while ((cmd = next_return(&io, &tr))) {
+			if (cmd != BR_TRANSACTION)
+				continue;
+
+			if (tr.offsets_size) {
+				obj = (const void *)
+					((const char *)tr.data.ptr.buffer +
+					 *(const size_t *)tr.data.ptr.offsets);
+				if (obj->type == BINDER_TYPE_FD)
+					close(obj->handle);
+			}
+			free_buffer(&io, &tr);
+
+			if (!(tr.flags & TF_ONE_WAY)) {
+				memset(&reply, 0, sizeof(reply));
+				if (tr.code == CODE_ECHO)
+					reply.data_size = reply_size;
+				reply.data.ptr.buffer = reply_data;
+				put_cmd(&io, BC_REPLY, &reply, sizeof(reply));
+			}
+
+			if (tr.code == CODE_EXIT &&
+			    __sync_add_and_fetch(&server_exits, 1) ==
+			    (int)threads) {
+				binder_io_xfer(&io, false);
+				exit(0);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void run_server(unsigned int index)
+{
+	struct binder_io io;
+	struct binder_transaction_data reply;
+	struct register_req req;
+	size_t offset = offsetof(struct register_req, obj);
+	pthread_t tid;
+	unsigned int i;
+
+	if (binder_setup(false))
+		barf("server: cannot open " BINDER_DEV);
+	if (ioctl(binder_fd, BINDER_SET_MAX_THREADS, &(size_t){ 0 }) < 0)
+		barf("server: BINDER_SET_MAX_THREADS");
+
+	binder_io_init(&io);
+	memset(&req, 0, sizeof(req));
+	req.index = index;
+	req.obj.type = BINDER_TYPE_BINDER;
+	req.obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	req.obj.binder = (void *)(uintptr_t)(index + 1);
+	req.obj.cookie = req.obj.binder;
+	if (binder_call(&io, 0, CODE_REGISTER, &req, sizeof(req),
+			&offset, sizeof(offset), 0, &reply) != BR_REPLY)
+		barf("server: registration failed");
+	free_buffer(&io, &reply);
+	binder_io_xfer(&io, false);
+
+	for (i = 1; i < threads; i++)
+		if (pthread_create(&tid, NULL, server_thread, NULL))
+			barf("server: pthread_create");
+	server_thread(NULL);
+}
+
+/* clients */
+
+static uint32_t server_handle;
+static bool oneway;
+
+static uint32_t lookup_server(unsigned int index)
+{
+	struct binder_io io;
+	struct binder_transaction_data reply;
+	const struct flat_binder_object *obj;
+	uint32_t handle = 0;
+
+	binder_io_init(&io);
+	while (!handle) {
+		if (binder_call(&io, 0, CODE_LOOKUP, &index, sizeof(index),
+				NULL, 0, 0, &reply) != BR_REPLY)
+			barf("client: lookup failed");
+		if (reply.offsets_size) {
+			obj = reply.data.ptr.buffer;
+			handle = obj->handle;
+			put_u32(&io, BC_ACQUIRE, handle);
+		}
+		free_buffer(&io, &reply);
+		binder_io_xfer(&io, false);
+		if (!handle)
+			usleep(1000);
+	}
+	return handle;
+}
+
+static void *client_thread(void *arg)
+{
+	struct histogram *hist = arg;
+	struct binder_io io;
+	struct binder_transaction_data reply;
+	struct flat_binder_object *obj;
+	size_t offset = 0;
+	uint8_t *data;
+	uint32_t flags = oneway ? TF_ONE_WAY : TF_ACCEPT_FDS;
+	uint32_t cmd;
+	unsigned int i;
+	u64 start;
+	int fd = -1;
+
+	data = calloc(1, req_size > sizeof(*obj) ? req_size : sizeof(*obj));
+	if (!data)
+		barf("client: calloc");
+	if (pass_fd) {
+		fd = open("/dev/null", O_RDONLY);
+		if (fd < 0)
+			barf("client: open /dev/null");
+		obj = (struct flat_binder_object *)data;
+		obj->type = BINDER_TYPE_FD;
+		obj->handle = fd;
+	}
+
+	binder_io_init(&io);
+	for (i = 0; i < loops; i++) {
+		start = rdclock();
+		cmd = binder_call(&io, server_handle, CODE_ECHO, data,
+				  pass_fd && req_size < sizeof(*obj) ?
+				  sizeof(*obj) : req_size,
+				  pass_fd ? &offset : NULL,
+				  pass_fd ? sizeof(offset) : 0,
+				  flags, &reply);
+		if (cmd == BR_FAILED_REPLY && oneway) {
+			/* async space of the server is exhausted, back off */
+			hist->retries++;
+			i--;
+			sched_yield();
+			continue;
+		}
+		if (cmd != (oneway ? BR_TRANSACTION_COMPLETE : BR_REPLY))
+			barf("client: transaction failed");
+		hist_add(hist, rdclock() - start);
+		if (!oneway)
+			free_buffer(&io, &reply);
+	}
+
+	/*
+	 * One-way calls to a node are delivered in order, so a one-way EXIT
+	 * only reaches the server after it has drained everything we sent.
+	 */
+	if (binder_call(&io, server_handle, CODE_EXIT, NULL, 0, NULL, 0,
+			oneway ? TF_ONE_WAY : 0, &reply) == BR_REPLY)
+		free_buffer(&io, &reply);
+	binder_io_xfer(&io, false);
+
+	if (fd >= 0)
+		close(fd);
+	free(data);
+	return NULL;
+}
+
+static void run_client(unsigned int index, int ready_out, int wakefd,
+		       int result_out)
+{
+	struct histogram *hist, *total;
+	pthread_t *tids;
+	unsigned int i;
+	char dummy = 0;
+	size_t done;
+	ssize_t ret;
+
+	if (binder_setup(false))
+		barf("client: cannot open " BINDER_DEV);
+	server_handle = lookup_server(index);
+
+	hist = calloc(threads + 1, sizeof(*hist));
+	tids = calloc(threads, sizeof(*tids));
+	if (!hist || !tids)
+		barf("client: calloc");
+	total = &hist[threads];
+	for (i = 0; i <= threads; i++)
+		hist_init(&hist[i]);
+
+	/* wait until every pair is connected */
+	if (write(ready_out, &dummy, 1) != 1)
+		barf("client: ready write");
+	if (read(wakefd, &dummy, 1) != 1)
+		barf("client: wake read");
+
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tids[i], NULL, client_thread, &hist[i]))
+			barf("client: pthread_create");
+	for (i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+		hist_merge(total, &hist[i]);
+	}
+
+	for (done = 0; done < sizeof(*total); done += ret) {
+		ret = write(result_out, (char *)total + done,
+			    sizeof(*total) - done);
+		if (ret <= 0)
+			barf("client: result write");
+	}
+	exit(0);
+}
+
+static int bench_binder_common(void)
+{
+	int ready[2], wake[2], result[2];
+	struct histogram *total, hist;
+	pthread_t manager;
+	pid_t *pids;
+	unsigned int i, nr_pids = 0;
+	u64 start, elapsed;
+	char dummy;
+	size_t done;
+	ssize_t ret;
+	int err, status, failed = 0;
+
+	if (!threads || !pairs) {
+		fprintf(stderr, "binder: need at least one pair and thread\n");
+		return 1;
+	}
+	if (req_size > BINDER_MAP_SIZE / 4 || reply_size > BINDER_MAP_SIZE / 4) {
+		fprintf(stderr, "binder: payload limited to %d bytes\n",
+			BINDER_MAP_SIZE / 4);
+		return 1;
+	}
+
+	err = binder_setup(true);
+	if (err) {
+		fprintf(stderr, "binder: cannot become context manager on "
+			BINDER_DEV " (%s), is servicemanager running?\n",
+			strerror(-err));
+		return 1;
+	}
+
+	server_handles = calloc(pairs, sizeof(*server_handles));
+	pids = calloc(pairs * 2, sizeof(*pids));
+	total = malloc(sizeof(*total));
+	if (!server_handles || !pids || !total)
+		barf("calloc");
+	hist_init(total);
+
+	if (pipe(ready) || pipe(wake) || pipe(result))
+		barf("pipe");
+
+	manager_stop = 0;
+	if (pthread_create(&manager, NULL, manager_thread, NULL))
+		barf("pthread_create");
+
+	fflush(stdout);
+	for (i = 0; i < pairs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			barf("fork");
+		if (!pid) {
+			close(binder_fd);
+			run_server(i);
+		}
+		pids[nr_pids++] = pid;
+
+		pid = fork();
+		if (pid < 0)
+			barf("fork");
+		if (!pid) {
+			close(binder_fd);
+			run_client(i, ready[1], wake[0], result[1]);
+		}
+		pids[nr_pids++] = pid;
+	}
+
+	for (i = 0; i < pairs; i++)
+		if (read(ready[0], &dummy, 1) != 1)
+			barf("ready read");
+
+	start = rdclock();
+	for (i = 0; i < pairs; i++)
+		if (write(wake[1], &dummy, 1) != 1)
+			barf("wake write");
+
+	for (i = 0; i < pairs; i++) {
+		for (done = 0; done < sizeof(hist); done += ret) {
+			ret = read(result[0], (char *)&hist + done,
+				   sizeof(hist) - done);
+			if (ret <= 0)
+				barf("result read");
+		}
+		hist_merge(total, &hist);
+	}
+
+	/* servers only exit once they have consumed every transaction */
+	for (i = 0; i < nr_pids; i++) {
+		if (waitpid(pids[i], &status, 0) != pids[i] ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	}
+	elapsed = rdclock() - start;
+
+	manager_stop = 1;
+	pthread_join(manager, NULL);
+	close(binder_fd);
+	close(ready[0]); close(ready[1]);
+	close(wake[0]); close(wake[1]);
+	close(result[0]); close(result[1]);
+
+	if (failed)
+		fprintf(stderr, "binder: %d benchmark processes failed\n",
+			failed);
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %u pairs, %u threads per pair, %u %s transactions "
+		       "of %u bytes per thread%s\n\n", pairs, threads, loops,
+		       oneway ? "one-way" : "synchronous", req_size,
+		       pass_fd ? " with an fd" : "");
+		printf(" %14s: %llu.%03llu [sec]\n\n", "Total time",
+		       (unsigned long long)(elapsed / NSEC_PER_SEC),
+		       (unsigned long long)(elapsed % NSEC_PER_SEC / 1000000));
+		printf(" %14.0f ops/sec\n",
+		       total->nr * (double)NSEC_PER_SEC / elapsed);
+		if (total->retries)
+			printf(" %14llu async space retries\n",
+			       (unsigned long long)total->retries);
+		printf("\n");
+		hist_print(total);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%.0f %.3f %.3f %.3f %.3f\n",
+		       total->nr * (double)NSEC_PER_SEC / elapsed,
+		       hist_percentile(total, 50) / 1000.0,
+		       hist_percentile(total, 90) / 1000.0,
+		       hist_percentile(total, 99) / 1000.0,
+		       total->max / 1000.0);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	free(total);
+	free(pids);
+	free(server_handles);
+	return failed ? 1 : 0;
+}
+
+int bench_binder_latency(int argc, const char **argv,
+			 const char *prefix __used)
+{
+	argc = parse_options(argc, argv, options,
+			     bench_binder_latency_usage, 0);
+	oneway = false;
+	return bench_binder_common();
+}
+
+int bench_binder_oneway(int argc, const char **argv,
+			const char *prefix __used)
+{
+	argc = parse_options(argc, argv, options,
+			     bench_binder_oneway_usage, 0);
+	oneway = true;
+	return bench_binder_common();
+}
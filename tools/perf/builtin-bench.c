@@ -13,6 +13,7 @@
  * Available subsystem list:
  *  sched ... scheduler and IPC mechanism
  *  mem   ... memory access performance
+ *  binder ... Android binder IPC
  *
  */
 
@@ -58,6 +59,19 @@ static struct bench_suite mem_suites[] = {
 	  NULL             }
 };
 
+static struct bench_suite binder_suites[] = {
+	{ "latency",
+	  "Round trip latency of synchronous binder transactions",
+	  bench_binder_latency },
+	{ "oneway",
+	  "Throughput of one-way binder transactions",
+	  bench_binder_oneway  },
+	suite_all,
+	{ NULL,
+	  NULL,
+	  NULL                 }
+};
+
 struct bench_subsys {
 	const char *name;
 	const char *summary;
@@ -71,6 +85,9 @@ static struct bench_subsys subsystems[] = {
 	{ "mem",
 	  "memory access performance",
 	  mem_suites },
+	{ "binder",
+	  "Android binder IPC",
+	  binder_suites },
 	{ "all",		/* sentinel: easy for help */
 	  "test all subsystem (pseudo subsystem)",
 	  NULL },